@@ -22,7 +22,8 @@ Download for Windows: https://github.com/opencv/opencv/releases
 #ifdef _WIN32 
 //Windows version
 int main(){
-    std::string path, mastercam_file, slavecam_file, config_file;
+    std::string path, mastercam_file, slavecam_file, config_file, sidecar_file;
+    bool series = false, watch = false, defects = false, apply = false;
     mastercam_file = "master_f1.4_3s_00001_000001.tif";
     slavecam_file = "slave_f1.4_3s_00001_000001.tif";
     config_file = "config.cfg";
@@ -31,8 +32,30 @@ int main(){
 #else
 //linux and mac code goes here
 int main(int argc, const char** argv) {
-    std::string path, mastercam_file, slavecam_file, config_file;
-    if (argc == 5) {
+    std::string path, mastercam_file, slavecam_file, config_file, sidecar_file;
+    bool series = false, watch = false, defects = false, apply = false;
+    if (argc == 5 && std::string(argv[1]) == "-defects") {
+        defects = true;
+        path = argv[2];
+        mastercam_file = argv[3];
+        config_file = argv[4];
+    }
+    else if (argc == 6 && std::string(argv[1]) == "-apply") {
+        apply = true;
+        path = argv[2];
+        mastercam_file = argv[3];
+        sidecar_file = argv[4];
+        config_file = argv[5];
+    }
+    else if (argc == 6 && (std::string(argv[1]) == "-series" || std::string(argv[1]) == "-watch")) {
+        series = std::string(argv[1]) == "-series";
+        watch = !series;
+        path = argv[2];
+        mastercam_file = argv[3];
+        slavecam_file = argv[4];
+        config_file = argv[5];
+    }
+    else if (argc == 5) {
         path = argv[1];
         mastercam_file = argv[2];
         slavecam_file = argv[3];
@@ -44,6 +67,16 @@ int main(int argc, const char** argv) {
         std::cerr << "<MasterCam_image> is the picture in .tif or .fit format in where the pixel value with coordinates from <hotpixels_file> will be replaced with the pixel values of the same coordinates from the <SlaveCam_image>." << std::endl;
         std::cerr << "<SlaveCam_image> is the picture in .tif or .fit format to use to correct the values in the picture from the Master Cammera." << std::endl ;
         std::cerr << "<configfile> is the config file where registration points are stored." << std::endl << std::endl;
+        std::cerr << "Series usage: ./command -series <path> <MasterCam_pattern> <SlaveCam_pattern> <configfile>" << std::endl;
+        std::cerr << "<MasterCam_pattern> selects the master pictures in <path> with one '*' wildcard, e.g. master_*.tif." << std::endl;
+        std::cerr << "<SlaveCam_pattern> gives the slave picture of each master, the '*' is replaced by the part matched in the master name, e.g. slave_*.tif." << std::endl;
+        std::cerr << "Corrected pictures are written as Corregida_<MasterCam_image>." << std::endl << std::endl;
+        std::cerr << "Watch usage: ./command -watch <path> <MasterCam_pattern> <SlaveCam_pattern> <configfile>" << std::endl;
+        std::cerr << "Same as series, but keeps running and corrects each pair as soon as both pictures are written in <path>. <configfile> is read again when it changes. Stop with Ctrl+C." << std::endl << std::endl;
+        std::cerr << "Defect map usage: ./command -defects <path> <Calibration_pattern> <configfile>" << std::endl;
+        std::cerr << "<Calibration_pattern> selects dark calibration pictures of the MasterCam in <path> with one '*' wildcard. Pixels hot in most of them are written to DefectMapFile, which is then corrected in every picture without detecting them." << std::endl << std::endl;
+        std::cerr << "Sidecar usage: ./command -apply <path> <MasterCam_image> <sidecar> <configfile>" << std::endl;
+        std::cerr << "<sidecar> is the .mcs file written for the raw <MasterCam_image> with OutputMode=1 or 2. The corrected picture is written with the name of the sidecar and the extension of <MasterCam_image>." << std::endl << std::endl;
 	exit(0);
     }
 #endif
@@ -54,6 +87,31 @@ int main(int argc, const char** argv) {
     /////////////////////////////
     std::vector<ConfigParameters> config_parameters = Init(path, config_file);
 
+    //// Defect map from calibration pictures
+    if (defects) {
+        return DefectMapBuild(mastercam_file, config_parameters) ? 0 : 1;
+    }
+
+    //// Corrected picture from the raw master and its sidecar
+    if (apply) {
+        return SidecarWrite(mastercam_file, sidecar_file, config_parameters) ? 0 : 1;
+    }
+
+    //// Series mode: every pair of the scan in this process
+    if (series) {
+        return SeriesCorrect(mastercam_file, slavecam_file, config_parameters) ? 0 : 1;
+    }
+
+    //// Watch mode: correct the pairs while they are acquired
+    if (watch) {
+        return WatchCorrect(mastercam_file, slavecam_file, config_file, config_parameters) ? 0 : 1;
+    }
+
+    //// In-memory pipeline: decode each input once and write only the corrected master
+    if (GetParameterValueFromConfig(config_parameters, "InMemoryPipeline") != 0) {
+        return PipelineCorrect(mastercam_file, slavecam_file, IsFitsFile(mastercam_file) ? "MasterCorregida.fits" : "MasterCorregida.tif", config_parameters) ? 0 : 1;
+    }
+
     /////////////////////////////
     ////  PROGRAM START      ////
     /////////////////////////////
@@ -104,11 +162,13 @@ int main(int argc, const char** argv) {
     ////  OPTIONAL IMAGES WITH CIRCLES      ////
     ////////////////////////////////////////////
 
-    //// Draw circles around flathotpoints in Master and Slave flat images
-    ImageDrawCirclesAroundPoints("SlaveFinalAdjusted.tif", flathotpoints);
-    ImageDrawCirclesAroundPoints("MasterFinal.tif", flathotpoints);
-    ImageDrawCirclesAroundPoints("MasterCorregida.tif", hotpoints_i);
-    ImageDrawCirclesAroundPoints(mastercam_file, hotpoints_i);
+    //// Draw circles around flathotpoints in Master and Slave flat images, only with Diagnostics in the config file
+    if (GetParameterValueFromConfig(config_parameters, "Diagnostics") != 0) {
+        ImageDrawCirclesAroundPoints("SlaveFinalAdjusted.tif", flathotpoints);
+        ImageDrawCirclesAroundPoints("MasterFinal.tif", flathotpoints);
+        ImageDrawCirclesAroundPoints("MasterCorregida.tif", hotpoints_i);
+        ImageDrawCirclesAroundPoints(mastercam_file, hotpoints_i);
+    }
 
     
     return 0;
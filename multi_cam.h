@@ -5,18 +5,63 @@
 #include <cstring>
 #include <cstdlib>
 #include <vector>
+#include <climits>
+#include <memory>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <csignal>
+#include <set>
+#include <map>
+#include <cfloat>
+#include <stdint.h>
+#include <tiffio.h>
+#include <zlib.h>
+#ifdef MULTICAM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <sstream>
+#include <ctime>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 #ifdef _WIN32 
 //Windows version
 #include <Windows.h>
 #include <tchar.h>
+#include <intrin.h>
+#include <psapi.h>
 
 #else
 //linux and mac code goes here
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #endif
 
+//The library (multi_cam_lib.cpp) defines MULTI_CAM_LIBRARY to compile everything below with internal linkage, so it only exports the API of multi_cam_lib.h
+#ifdef MULTI_CAM_LIBRARY
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wunused-function" //the library calls a few of them
+#endif
+namespace {
+#endif
+
 //Class to store point coordinates and gray value
 class Coords {
 public:
@@ -28,9 +73,115 @@ class ConfigParameters {
 public:
     std::string parameter; //parameter name from config file
     double value; //value corresponding to the parameter
+    std::string text; //value as written in the config file, for parameters that are file names
+};
+
+//Class to map a whole file in memory. The mapping is released when the object is destroyed.
+class MappedFile {
+public:
+    unsigned char* data; //first byte of the file, NULL if not mapped
+    size_t size; //size of the file in bytes
+
+    MappedFile() : data(NULL), size(0) {
+#ifdef _WIN32 
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        fd = -1;
+#endif
+    }
+    ~MappedFile() { Close(); }
+
+    /************************
+    Map a file.
+    <filename> is the file to map.
+    <writable> maps the file read-write, changes go to the file. Otherwise it is mapped read-only.
+    Returns true if execution was correct.
+    *************************/
+    bool Open(std::string filename, bool writable) {
+        Close();
+#ifdef _WIN32 
+        file = CreateFileA(filename.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER filesize;
+        if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart == 0) { Close(); return false; }
+        size = (size_t)filesize.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) { Close(); return false; }
+        data = (unsigned char*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+        if (data == NULL) { Close(); return false; }
+#else
+        fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { Close(); return false; }
+        size = (size_t)st.st_size;
+        void* address = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) { Close(); return false; }
+        data = (unsigned char*)address;
+#endif
+        return true;
+    }
+
+    /************************
+    Unmap the file.
+    *************************/
+    void Close() {
+#ifdef _WIN32 
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        if (data) munmap(data, size);
+        if (fd >= 0) close(fd);
+        fd = -1;
+#endif
+        data = NULL;
+        size = 0;
+    }
+
+private:
+#ifdef _WIN32 
+    HANDLE file, mapping;
+#else
+    int fd;
+#endif
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
 };
 
 
+/************************
+Read a config file into a vector of ConfigParameters, without printing or exiting (see GetConfigFile()).
+<filename> is the filename containing the registration points and config variables.
+<config_parameters> receives the parameter names and values.
+Returns true if the file could be read.
+*************************/
+bool ReadConfigFile(std::string filename, std::vector<ConfigParameters>& config_parameters) {
+    config_parameters.clear();
+    ConfigParameters dummy;
+    std::ifstream cFile(filename.c_str());
+    if (!cFile.is_open()) return false;
+    std::string line;
+    while (getline(cFile, line)) {
+        line.erase(std::remove_if(line.begin(), line.end(), isspace),
+            line.end());
+        if (line.empty() || line[0] == '#')
+            continue;
+        int delimiterPos = line.find("=");
+        std::string name = line.substr(0, delimiterPos);
+        dummy.text = delimiterPos == (int)std::string::npos ? "" : line.substr(delimiterPos + 1);
+        double value = strtod(dummy.text.c_str(), NULL); //0 for text values such as file names
+        //std::cout << name << " " << value << '\n';
+        dummy.parameter = name;
+        dummy.value = value;
+        config_parameters.push_back(dummy);
+    }
+    return true;
+}
+
 /************************
 Open Config File and return all the values in a vector of ConfigParameters.
 <filename> is the filename containing the registration points and config variables.
@@ -39,29 +190,8 @@ Returns a vector of ConfigParameters that has parameter names and values.
 std::vector<ConfigParameters> GetConfigFile(std::string filename)
 {
     std::vector<ConfigParameters> config_parameters;
-    ConfigParameters dummy;
     std::cout << "Read Config file: " << filename << "... ";
-
-    std::ifstream cFile(filename.c_str());
-    if (cFile.is_open())
-    {
-        std::string line;
-        while (getline(cFile, line)) {
-            line.erase(std::remove_if(line.begin(), line.end(), isspace),
-                line.end());
-            if (line[0] == '#' || line.empty())
-                continue;
-            int delimiterPos = line.find("=");
-            std::string name = line.substr(0, delimiterPos);
-            double value = stof(line.substr(delimiterPos + 1));
-            //std::cout << name << " " << value << '\n';
-            dummy.parameter = name;
-            dummy.value = value;
-            config_parameters.push_back(dummy);
-        }
-
-    }
-    else {
+    if (!ReadConfigFile(filename, config_parameters)) {
         std::cerr << "Couldn't open config file for reading.\n";
         exit(0);
     }
@@ -70,6 +200,32 @@ std::vector<ConfigParameters> GetConfigFile(std::string filename)
 }
 
 
+/************************
+Find the first parameter a correction needs that a config does not set: the registration points of both images and MasterThresholdHotPixels.
+<config_parameters> is generated with ReadConfigFile() or GetConfigFile().
+Returns the name of the missing parameter, empty if there is none.
+*************************/
+std::string ConfigMissingParameter(const std::vector<ConfigParameters>& config_parameters) {
+    std::set<std::string> names;
+    for (size_t i = 0; i < config_parameters.size(); i++) names.insert(config_parameters[i].parameter);
+    const char* images[2] = { "Master", "Slave" };
+    const char* points[2] = { "Source", "Dest" };
+    const char* corners[4] = { "TopLeft", "TopRight", "BottomLeft", "BottomRight" };
+    const char* axes[2] = { "X", "Y" };
+    for (int image = 0; image < 2; image++) {
+        for (int point = 0; point < 2; point++) {
+            for (int corner = 0; corner < 4; corner++) {
+                for (int axis = 0; axis < 2; axis++) {
+                    std::string name = std::string(images[image]) + points[point] + corners[corner] + axes[axis];
+                    if (!names.count(name)) return name;
+                }
+            }
+        }
+    }
+    if (!names.count("MasterThresholdHotPixels")) return "MasterThresholdHotPixels";
+    return "";
+}
+
 /************************
 Initialize program. First set working directory and then read config file. 
 <path> is the working path to change working directory to. 
@@ -112,7 +268,7 @@ std::vector<ConfigParameters> Init(std::string path, std::string config_file) {
 
 /************************
 Get list of hotpoints from file. 
-<filename> is a text file containing a list of x y coordinates of hotpoints. Each raw is a point.
+<filename> is a text file containing a list of x y coordinates of hotpoints. Each raw is a point, text after '#' is a comment.
 Returns vector of points containing the coordinates of the values read from file.
 *************************/
 std::vector<cv::Point2f> GetPointsFromFile(std::string filename)
@@ -123,20 +279,17 @@ std::vector<cv::Point2f> GetPointsFromFile(std::string filename)
     std::vector<cv::Point2f> points;
     std::cout << "Read file: " << filename << "... ";
 
-    std::string x, y;
+    std::string line;
     std::ifstream cFile(filename.c_str());
     if (cFile.is_open())
     {
-        while (!cFile.eof()) {
-            cFile >> x;
-            if (x.at(0) == '#') {
-                cFile.ignore(1, '\n');
-                continue;
-            }
-            if (cFile.eof())break;
-            cFile >> y;
-            if (cFile.eof())break;
-            points.push_back(cv::Point2f(stof(x), stof(y)));
+        //// One point per row, '#' starts a comment up to the end of the row
+        while (std::getline(cFile, line)) {
+            size_t comment = line.find('#');
+            if (comment != std::string::npos) line.erase(comment);
+            std::istringstream fields(line);
+            float x, y;
+            if (fields >> x >> y) points.push_back(cv::Point2f(x, y));
         }
 
     }
@@ -154,7 +307,7 @@ Read table of points from config parameters and return the string of floats need
 <image> must be "Slave" or "Master"
 returns <points>
 *************************/
-double* GetPerspectivePointsFromConfig(std::vector<ConfigParameters> config_parameters, double points[], std::string image) {
+double* GetPerspectivePointsFromConfig(const std::vector<ConfigParameters>& config_parameters, double points[], std::string image) {
     for (int i = 0; i < config_parameters.size(); i++) {
         if (config_parameters[i].parameter == image + "SourceTopLeftX") {
             points[0] = config_parameters[i].value;
@@ -214,7 +367,7 @@ Read table of points from config parameters and return the string of floats need
 <name> is the parameter name to look for.
 Returns the parameter value specified.
 *************************/
-double GetParameterValueFromConfig(std::vector<ConfigParameters> config_parameters, std::string name) {
+double GetParameterValueFromConfig(const std::vector<ConfigParameters>& config_parameters, std::string name) {
     for (int i = 0; i < config_parameters.size(); i++) {
         if (config_parameters[i].parameter == name) {
             return config_parameters[i].value;
@@ -224,272 +377,1448 @@ double GetParameterValueFromConfig(std::vector<ConfigParameters> config_paramete
 }
 
 /************************
-Open image and look for pixel coordinates with values higher or equal to threshold. 
-<image_name is a grayscale image file. 
-<threshold> is the value from 0-65535 (black to white).
-Returnds vector of points containing coordinates of points with value above or equal to threshold.
+Get the text of a parameter of the config file, for parameters that are not numbers (e.g. file names).
+<config_parameters> is generated with GetConfigFile().
+<name> is the parameter name to look for.
+Returns the text of the parameter, empty if it is not in the config file.
 *************************/
-std::vector<cv::Point2f> ImageGetHotPoints(std::string image_name, long threshold) {
+std::string GetTextFromConfig(const std::vector<ConfigParameters>& config_parameters, std::string name) {
+    for (size_t i = 0; i < config_parameters.size(); i++) {
+        if (config_parameters[i].parameter == name) {
+            return config_parameters[i].text;
+        }
+    }
+    return "";
+}
 
-    std::cout << "FIND HOT PIXELS IN " + image_name << std::endl;
+/************************
+Read the perspective quad-points of an image from config parameters.
+<image_type> is either "Slave" or "Master".
+<config_parameters> contains the table of pixel coordinates. It is generated with GetConfigFile().
+<src> and <dst> receive the 4 source and destination points, clockwise from top-left.
+*************************/
+void GetQuadPointsFromConfig(std::string image_type, const std::vector<ConfigParameters>& config_parameters, cv::Point2f src[4], cv::Point2f dst[4]) {
+    /////Perspective source quad-points and destination quad-points, clockwise
+    src[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftY"));
+    src[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightY"));
+    src[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightY"));
+    src[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftY"));
+    dst[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftY"));
+    dst[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightY"));
+    dst[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightY"));
+    dst[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftY"));
+}
 
-    ////Return vector definition
-    std::vector<cv::Point2f> hotpoints;
-    cv::Point2f dummy;
+/************************
+Build the 3x3 matrix that rotates and compensates perspective distortion of a raw image, i.e. the perspective transformation applied after the rotation around the origin.
+<image_type> is either "Slave" or "Master".
+<config_parameters> contains the table of pixel coordinates. It is generated with GetConfigFile().
+Returns the CV_64F 3x3 matrix taking raw coordinates to flat coordinates.
+*************************/
+cv::Mat GetRotationAndPerspectiveMatrix(std::string image_type, const std::vector<ConfigParameters>& config_parameters) {
+    cv::Point2f src[4], dst[4];
+    GetQuadPointsFromConfig(image_type, config_parameters, src, dst);
 
-    /////Input and Output Image matrices;
-    cv::Mat input, output, output2;
+    //// Rotation around origin as a 3x3 matrix
+    cv::Point origin = cv::Point(0, 0);
+    cv::Mat rotmat = getRotationMatrix2D(origin, GetParameterValueFromConfig(config_parameters, image_type + "Rotation"), 1);
+    cv::Mat rotation = cv::Mat::eye(3, 3, CV_64F);
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < 3; c++) {
+            rotation.at<double>(r, c) = rotmat.at<double>(r, c);
+        }
+    }
 
-    //// Create a wand 
-    MagickWand* mw = NULL;
-    MagickWandGenesis();
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
+    //// Perspective after rotation
+    cv::Mat perspmat = getPerspectiveTransform(src, dst);
+    cv::Mat matrix = perspmat * rotation;
+    return matrix;
+}
 
-    //// Open image
-    std::cout << "Opening file: " << image_name << " to get bad pixel values... ";
-    if (!MagickReadImage(mw, image_name.c_str())) {
-        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
-        exit(0);
+/************************
+***** INSTRUMENTATION AND LOGGING *****
+Timing and resources of every pipeline stage of every frame (InstrumentationFile in the config file), exported as CSV, JSON and Chrome trace events (open the .trace.json file in https://ui.perfetto.dev).
+Messages of the pipeline go to a leveled logger (LogLevel and LogFile in the config file) written by a background thread, so stages do not wait for the console.
+*************************/
+
+//Levels of the logger, LogLevel in the config file keeps the messages up to that level
+const int LOG_ERROR = 0;
+const int LOG_WARNING = 1;
+const int LOG_INFO = 2;
+const int LOG_DEBUG = 3;
+
+//Class of the buffered logger: messages are queued by LogMessage() and written in batches by a background thread
+class Logger {
+public:
+    std::atomic<int> level; //LogLevel: messages above it are discarded before being formatted
+    std::chrono::steady_clock::time_point origin; //time 0 of the messages
+
+    Logger() : level(LOG_INFO), origin(std::chrono::steady_clock::now()), writing(false), stopping(false) {}
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        if (writer.joinable()) writer.join();
     }
-    else {
-        std::cout << "OK!" << std::endl;
+
+    //Queue a message, the writer thread is started with the first one
+    void Push(int message_level, const std::string& text) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - origin).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!writer.joinable()) writer = std::thread(&Logger::Run, this);
+        lines.push_back(LogEntry(message_level, ms, text));
+        ready.notify_one();
     }
 
-    std::cout << "Looking for hot pixels with value >="<<threshold<<"... ";
+    //Set the level and the file of the messages (console if empty), safe while other threads log
+    void Configure(int new_level, const std::string& file) {
+        std::lock_guard<std::mutex> lock(mutex);
+        level = new_level;
+        filename = file;
+    }
 
-    //// Pixel region iterator and pixel wand to get px input info
-    PixelIterator* imw;
-    PixelWand** pmw;
-    long y;
-    long x;
-    long v;
-    std::vector<Coords> coordinates;
-    Coords dummycoords;
-    size_t width, height;
-
-    //// Scan the whole image
-    width = MagickGetImageWidth(mw);
-    height = MagickGetImageHeight(mw);
-    imw = NewPixelIterator(mw); //pixel iterator
-    for (int y = 0; y < height; y++) {
-        ///// Get the next row from each image
-        pmw = PixelGetNextIteratorRow(imw, &width);
-        for (x = 0; x < (long)width; x++) {
-            v = PixelGetRedQuantum(pmw[x]);
-            if (v >= threshold) {
-                dummycoords.v = v;
-                dummycoords.x = x;
-                dummycoords.y = y;
-                //std::cout<<x<<" "<<y<<" "<<v<<std::endl;
-                coordinates.push_back(dummycoords);
-                dummy = cv::Point(x, y);
-                hotpoints.push_back(dummy);
+    //Wait until the queued messages are written
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [this]() { return lines.empty() && !writing; });
+    }
+
+private:
+    struct LogEntry {
+        int level;
+        double ms;
+        std::string text;
+        LogEntry(int l, double m, const std::string& t) : level(l), ms(m), text(t) {}
+    };
+    std::mutex mutex;
+    std::condition_variable ready, written;
+    std::string filename; //LogFile: messages are appended to this file, to the console if empty
+    std::deque<LogEntry> lines; //messages waiting for the writer
+    std::thread writer;
+    bool writing, stopping;
+
+    //Writer thread: take all the queued messages, format them and flush once per batch
+    void Run() {
+        static const char* names[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+        std::ofstream file;
+        std::string opened;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this]() { return !lines.empty() || stopping; });
+            if (lines.empty()) break;
+            std::deque<LogEntry> batch;
+            batch.swap(lines);
+            std::string target = filename;
+            writing = true;
+            lock.unlock();
+
+            if (target != opened) {
+                if (file.is_open()) file.close();
+                if (!target.empty()) file.open(target.c_str(), std::ios::app);
+                opened = target;
             }
+            for (size_t i = 0; i < batch.size(); i++) {
+                char prefix[32];
+                snprintf(prefix, sizeof(prefix), "[%10.3f] %s ", batch[i].ms / 1000.0, names[std::min(std::max(batch[i].level, LOG_ERROR), LOG_DEBUG)]);
+                if (file.is_open()) file << prefix << batch[i].text << '\n';
+                else if (batch[i].level <= LOG_WARNING) {
+                    std::cout.flush(); //keep the order of the messages
+                    std::cerr << batch[i].text << '\n';
+                }
+                else std::cout << batch[i].text << '\n';
+            }
+            if (file.is_open()) file.flush();
+            else std::cout.flush();
+
+            lock.lock();
+            writing = false;
+            written.notify_all();
         }
     }
-    std::cout << hotpoints.size() << " found!" << std::endl;
+};
 
-    ///// Clean up the iterators and magick wands
-    imw = DestroyPixelIterator(imw);
-    mw = DestroyMagickWand(mw);
-    MagickWandTerminus();
-    std::cout << std::endl;
-    return hotpoints;
-}
+Logger logger;
 
+//Class to build a message with << and queue it when the statement ends, e.g. LogLine(LOG_INFO) << "Found " << n;
+class LogLine {
+public:
+    LogLine(int level) : level(level) {}
+    ~LogLine() {
+        if (level <= logger.level) logger.Push(level, text.str());
+    }
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (level <= logger.level) text << value;
+        return *this;
+    }
 
-/************************
-Transform image to rotate and compensate perspective distortion. 
-<image_type> is either "Slave" or "Master". 
-<image_name> image file name to work with. 
-<config_parameters> contains the table of pixel coordinates as text file x y per row. It is generated with GetConfigFile().
-Returns true if execution was correct.
-*************************/
-bool ImageRotateAndPerspectiveTransformation(std::string image_type, std::string image_name, std::vector<ConfigParameters> config_parameters) {
+private:
+    int level;
+    std::ostringstream text;
+};
 
-    std::cout << "TRANSFORMATION OF " + image_type + " IMAGE" << std::endl;
+//Class to store the measurements of one stage of one frame
+class StageRecord {
+public:
+    std::string frame; //master file name of the pair
+    std::string stage; //decode, detect, sample, encode or stream
+    int thread; //number of the thread that ran the stage, in order of its first stage
+    double start_ms; //start of the stage since the process started
+    double wall_ms; //elapsed time
+    double cpu_ms; //CPU time of the thread and of the ParallelBands() workers it started
+    unsigned long long bytes_read, bytes_written; //size of the files read and written
+    unsigned long long pixels; //pixels scanned (decode, detect, stream) or sampled and set (sample, encode)
+    unsigned long long hot; //hot pixels found or corrected
+    long peak_rss_kb; //peak resident memory of the process when the stage ended, in KB
 
-    /////Input and Output Image matrices;
-    cv::Mat input, output, output2;
+    StageRecord() : thread(0), start_ms(0), wall_ms(0), cpu_ms(0), bytes_read(0), bytes_written(0), pixels(0), hot(0), peak_rss_kb(0) {}
+};
 
-    /////Load the image
-    std::cout << "Open file: " + image_name + "... ";
-    input = cv::imread(image_name.c_str(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
-    if (input.empty()) {
-        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
-        exit(0);
-    }
-    std::cout << "OK!" << std::endl;
+//Class to collect the stage records of all the frames, shared by the threads of the pipeline
+class Instrumentation {
+public:
+    bool enabled; //set by PipelineInit() when InstrumentationFile is in the config file
+    std::chrono::steady_clock::time_point origin; //time 0 of the records
+    std::mutex mutex;
+    std::vector<StageRecord> records; //records not written yet
+    std::map<std::thread::id, int> threads; //number of every thread seen, for the trace
+    std::string file; //InstrumentationFile the written records are in
+    size_t written; //records already written to it
 
-    /////Generate points for matrices generation
-    cv::Point2f src[4], dst[4];
-    /////Perspective source quad-points and destination quad-points, clockwise
-    src[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftY"));
-    src[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightY"));
-    src[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightY"));
-    src[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftY"));
-    dst[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftY"));
-    dst[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightY"));
-    dst[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightY"));
-    dst[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftY"));
+    Instrumentation() : enabled(false), origin(std::chrono::steady_clock::now()), written(0) {}
 
-    //////ROTATION//////
-    cv::Point origin = cv::Point(0, 0); //origin point set to 0,0 because rotations between images are calculated from there
-    /////Generation of rotation matrices for master image
-    double rotangle = GetParameterValueFromConfig(config_parameters, image_type + "Rotation");
-    std::cout << "Rotating " + image_type + " image with " << rotangle << " degrees... ";
-    cv::Mat rotmat = getRotationMatrix2D(origin, rotangle, 1);
-    //std::cout<<rotmat<<std::endl;
-    /////Rotate image
-    warpAffine(input, output, rotmat, output.size());
-    /////draw circle in points of rotated image to be used in perspective transformation
-    cv::circle(output, src[0], 15, cv::Scalar(0, 0, 0), 5, 1);
-    cv::circle(output, src[1], 15, cv::Scalar(0, 0, 0), 5, 1);
-    cv::circle(output, src[2], 15, cv::Scalar(0, 0, 0), 5, 1);
-    cv::circle(output, src[3], 15, cv::Scalar(0, 0, 0), 5, 1);
-    /////save rotated image
-    cv::imwrite(image_type + "Rotated.tif", output);
-    std::cout << "OK!" << std::endl;
+    void Add(StageRecord& record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::thread::id, int>::iterator thread = threads.find(std::this_thread::get_id());
+        if (thread == threads.end()) thread = threads.insert(std::make_pair(std::this_thread::get_id(), (int)threads.size() + 1)).first;
+        record.thread = thread->second;
+        records.push_back(record);
+    }
+};
 
-    //////PERSPECTIVE TRANSFORMATION///////
-    std::cout << "Applying Perspective Transformation for " + image_type + " image... ";
-    cv::Mat perspmat = getPerspectiveTransform(src, dst);
-    //std::cout<<perspmat<<std::endl;  
-    /////apply perspective transformation
-    warpPerspective(output, output2, perspmat, output2.size());
-    //Display input and output
-     //imshow("Input",input);
-     //here it should be the pause
-     //int k = cv::waitKey(0);
-     //if(k == 27){         //wait for ESC key to exit
-     //    cv::destroyAllWindows();
-     //}
+Instrumentation instrumentation;
 
-     /////Save final image
-    cv::imwrite(image_type + "Final.tif", output2);
-    std::cout << "OK!" << std::endl;
+//CPU time of the ParallelBands() workers started by this thread, added when they are joined
+thread_local double worker_cpu_ms = 0;
 
-    std::cout << std::endl;
-    return true;
+/************************
+CPU time used by the calling thread.
+Returns the time in milliseconds.
+*************************/
+double GetThreadCpuMs() {
+#ifdef _WIN32 
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return 0;
+    unsigned long long ticks = ((unsigned long long)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((unsigned long long)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    return ticks / 10000.0; //100 ns ticks
+#else
+    struct timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) return 0;
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+#endif
 }
 
 /************************
-Transform points of coordinates of pixels to rotate and compensate perspective distortion. 
-<image_type> is either "Slave" or "Master". 
-<hotpoints> is the input vector of point2f points to be transformed. It is generated with GetConfigFile().
-Returns vector of integer points transformed.
+Peak resident memory of the process.
+Returns the size in KB.
 *************************/
-std::vector<cv::Point2i> PointsRotateAndPerspectiveTransformation(std::string image_type, std::vector<cv::Point2f> hotpoints, std::vector<ConfigParameters> config_parameters) {
+long GetPeakRssKb() {
+#ifdef _WIN32 
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; //bytes on mac
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
 
-    std::cout << "TRANSFORMATION OF HOTPOINTS/" << std::endl;
+/************************
+Size of a file.
+<filename> is the file.
+Returns the size in bytes, 0 if it can't be opened.
+*************************/
+unsigned long long GetFileSize(const std::string& filename) {
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return 0;
+    return (unsigned long long)file.tellg();
+}
 
-    /////Generate points for matrices generation
-    cv::Point2f src[4], dst[4];
-    /////Perspective source quad-points and destination quad-points, clockwise
-    src[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopLeftY"));
-    src[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceTopRightY"));
-    src[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomRightY"));
-    src[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "SourceBottomLeftY"));
-    dst[0] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopLeftY"));
-    dst[1] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestTopRightY"));
-    dst[2] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomRightY"));
-    dst[3] = cv::Point2f(GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftX"), GetParameterValueFromConfig(config_parameters, image_type + "DestBottomLeftY"));
+//Class to time a stage from its construction to Stop() or its destruction. Does nothing unless the instrumentation is enabled; the counters of record are filled by the stage.
+class StageTimer {
+public:
+    StageRecord record;
+    bool running; //instrumentation is enabled and the stage has not been stopped
 
-    //////ROTATION//////
-    cv::Point origin = cv::Point(0, 0); //origin point set to 0,0 because rotations between images are calculated from there
-    //Generation of rotation matrices for master image
-    double rotangle = GetParameterValueFromConfig(config_parameters, image_type + "Rotation");
-    std::cout << "Rotating " + image_type + " raw image hotpoints " << rotangle << " degrees... ";
-    cv::Mat rotmat = getRotationMatrix2D(origin, rotangle, 1);
-    //std::cout<<rotmat<<std::endl;
-    /////Rotate points
-    std::vector<cv::Point2f> rotatedpoints;
-    transform(hotpoints, rotatedpoints, rotmat);
-    std::cout << "OK!" << std::endl;
+    StageTimer(const std::string& stage, const std::string& frame) : running(instrumentation.enabled) {
+        if (!running) return;
+        record.stage = stage;
+        record.frame = frame;
+        start = std::chrono::steady_clock::now();
+        cpu_start = GetThreadCpuMs() + worker_cpu_ms;
+    }
+    ~StageTimer() { Stop(); }
 
-    //////PERSPECTIVE TRANSFORMATION///////
-    std::cout << "Applying Perspective Transformation for " + image_type + " raw hotpoints... ";
-    cv::Mat perspmat = getPerspectiveTransform(src, dst);
-    //std::cout<<perspmat<<std::endl;
+    void Stop() {
+        if (!running) return;
+        running = false;
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        record.start_ms = std::chrono::duration<double, std::milli>(start - instrumentation.origin).count();
+        record.wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+        record.cpu_ms = GetThreadCpuMs() + worker_cpu_ms - cpu_start;
+        record.peak_rss_kb = GetPeakRssKb();
+        instrumentation.Add(record);
+    }
 
-    /////Apply perspective transformation
-    std::vector<cv::Point2f> finalpoints;
-    perspectiveTransform(rotatedpoints, finalpoints, perspmat);
-    std::cout << "OK!" << std::endl;
-    //std::cout<<"List of Flat hotpoints coordinates:"<<std::endl<<flathotpoints<<std::endl;
+private:
+    std::chrono::steady_clock::time_point start;
+    double cpu_start;
+};
 
-  /////Return vector of integer points rounded.
-    std::vector<cv::Point2i> dummy;
-    for (int i = 0; i < finalpoints.size(); i++) {
-        dummy.push_back(finalpoints[i]);
+/************************
+Escape a text to be written as a JSON string.
+<text> is the text.
+Returns the escaped text, without the quotes.
+*************************/
+std::string JsonEscape(const std::string& text) {
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += (char)c;
+        }
+        else if (c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else escaped += (char)c;
     }
-
-    std::cout << std::endl;
-    return dummy;
+    return escaped;
 }
 
 /************************
-Adjusts Brightness and Constrast of an image. 
-<image_name> contains the image path. 
-<brightness> is a value in percent -100 to 100. 
-<contrast> is a value in percent -100 to 100.
-Returns true if the execution was correct.
+Append the stage records not written yet to <filename>.csv, <filename>.json and <filename>.trace.json (Chrome trace event format), and remove them from memory. Can be called after every frame, the files are valid after each call.
+<filename> is InstrumentationFile of the config file, without extension. The files are rewritten when it changes.
+Returns true if execution was correct.
 *************************/
-bool ImageAdjustBrightnessContrast(std::string image_name, std::string output_name, double brightness, double contrast) {
-    std::cout << "ADJUST CONTRAST IN " + image_name << std::endl;
-    //// Create a wand 
-    MagickWand* mw = NULL;
-    MagickWandGenesis();
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
+bool InstrumentationFlush(std::string filename) {
+    static const char json_end[] = "\n]\n", trace_end[] = "\n]}\n";
+    std::lock_guard<std::mutex> lock(instrumentation.mutex);
+    if (filename != instrumentation.file) {
+        instrumentation.file = filename;
+        instrumentation.written = 0;
+    }
+    std::vector<StageRecord>& records = instrumentation.records;
+    if (records.empty() && instrumentation.written > 0) return true;
 
-    //// Open image
-    std::cout << "Opening file: " << image_name << " to adjust brightness and contrast... ";
-    if (!MagickReadImage(mw, image_name.c_str())) {
-        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
-        exit(0);
+    //// The first call creates the files, later calls append the records before the closing brackets
+    bool create = instrumentation.written == 0;
+    std::ofstream csv((filename + ".csv").c_str(), std::ios::binary | (create ? std::ios::trunc : std::ios::app));
+    std::fstream json((filename + ".json").c_str(), std::ios::binary | std::ios::in | std::ios::out | (create ? std::ios::trunc : std::ios::openmode()));
+    std::fstream trace((filename + ".trace.json").c_str(), std::ios::binary | std::ios::in | std::ios::out | (create ? std::ios::trunc : std::ios::openmode()));
+    if (!csv.is_open() || !json.is_open() || !trace.is_open()) {
+        LogLine(LOG_ERROR) << "Couldn't write the instrumentation files " << filename << ".*";
+        return false;
+    }
+    if (create) {
+        csv << "frame,stage,thread,start_ms,wall_ms,cpu_ms,bytes_read,bytes_written,pixels,hot,peak_rss_kb\n";
+        json << "[";
+        trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
     }
     else {
-        std::cout << "OK!" << std::endl;
+        json.seekp(-(std::streamoff)(sizeof(json_end) - 1), std::ios::end);
+        trace.seekp(-(std::streamoff)(sizeof(trace_end) - 1), std::ios::end);
     }
-
-    std::cout << "Adjusting Brightness " << brightness << "% and contrast " << contrast << "%... ";
-    MagickBrightnessContrastImage(mw, brightness, contrast);
-    MagickWriteImage(mw, output_name.c_str());
-    std::cout << "OK!" << std::endl;
-
-    mw = DestroyMagickWand(mw);
-    MagickWandTerminus();
-    std::cout << std::endl;
+    for (size_t i = 0; i < records.size(); i++) {
+        const StageRecord& r = records[i];
+        const char* separator = instrumentation.written + i > 0 ? ",\n" : "\n";
+        std::string frame = JsonEscape(r.frame);
+        std::string quoted = r.frame;
+        for (size_t p = quoted.find('"'); p != std::string::npos; p = quoted.find('"', p + 2)) quoted.insert(p, 1, '"');
+        csv << '"' << quoted << "\"," << r.stage << ',' << r.thread << ',' << r.start_ms << ',' << r.wall_ms << ',' << r.cpu_ms << ','
+            << r.bytes_read << ',' << r.bytes_written << ',' << r.pixels << ',' << r.hot << ',' << r.peak_rss_kb << '\n';
+        std::ostringstream counters;
+        counters << "\"cpu_ms\":" << r.cpu_ms << ",\"bytes_read\":" << r.bytes_read << ",\"bytes_written\":" << r.bytes_written
+                 << ",\"pixels\":" << r.pixels << ",\"hot\":" << r.hot << ",\"peak_rss_kb\":" << r.peak_rss_kb;
+        json << separator << "{\"frame\":\"" << frame << "\",\"stage\":\"" << r.stage << "\",\"thread\":" << r.thread << ",\"start_ms\":" << r.start_ms
+             << ",\"wall_ms\":" << r.wall_ms << ',' << counters.str() << '}';
+        trace << separator << "{\"name\":\"" << r.stage << "\",\"cat\":\"multi_cam\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r.thread
+              << ",\"ts\":" << (long long)(r.start_ms * 1000.0) << ",\"dur\":" << (long long)(r.wall_ms * 1000.0)
+              << ",\"args\":{\"frame\":\"" << frame << "\"," << counters.str() << "}}";
+    }
+    json << (instrumentation.written + records.size() > 0 ? json_end : json_end + 1);
+    trace << (instrumentation.written + records.size() > 0 ? trace_end : trace_end + 1);
+    instrumentation.written += records.size();
+    std::vector<StageRecord>().swap(records);
     return true;
 }
 
 /************************
-Draw circles around points for easy visualization of the pixels to be transformed. 
-<image_name> contains the image path. 
-<points> is a std::vector<cv::Point2i> of points to draw.
-Returns true if the execution was correct.
+Write the stage records left at the end of a run (see InstrumentationFlush()).
+<filename> is InstrumentationFile of the config file, without extension.
+Returns true if execution was correct.
 *************************/
-bool ImageDrawCirclesAroundPoints(std::string image_name, const std::vector<cv::Point2i>& points) {
-    std::cout << "DRAWING CIRCLES IN IMAGE " + image_name << std::endl;
-
-    /////Input and Output Image matrices;
-    cv::Mat input;
+bool InstrumentationSave(std::string filename) {
+    if (!InstrumentationFlush(filename)) return false;
+    size_t written;
+    {
+        std::lock_guard<std::mutex> lock(instrumentation.mutex);
+        written = instrumentation.written;
+    }
+    LogLine(LOG_INFO) << written << " stage records written to " << filename << ".csv, .json and .trace.json";
+    return true;
+}
 
-    /////Load the image
-    std::cout << "Open file: " + image_name + "... ";
-    input = cv::imread(image_name.c_str(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
-    if (input.empty()) {
+/************************
+Index of the lowest set bit of a non zero mask.
+*************************/
+inline int CountTrailingZeros(unsigned int mask) {
+#ifdef _WIN32 
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/************************
+Number of threads to use.
+<threads> is the requested number of threads, 0 or less for all the cores.
+Returns the number of threads, at least 1.
+*************************/
+int GetThreadCount(int threads) {
+    if (threads > 0) return threads;
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+/************************
+Split rows in consecutive bands and process each band on its own thread, the first band runs on the calling thread. Returns when all the bands are done.
+<rows> is the number of rows to split.
+<threads> is the number of bands, 0 for all the cores. It is limited to <rows>.
+<function> is called as function(band, first_row, end_row) for every band, end_row not included.
+Returns the number of bands used.
+*************************/
+int ParallelBands(int rows, int threads, const std::function<void(int, int, int)>& function) {
+    int bands = std::max(1, std::min(GetThreadCount(threads), rows));
+    std::vector<std::thread> workers;
+    std::vector<double> cpu_ms(bands, 0.0); //CPU time of each worker, for the instrumentation of the calling stage
+    for (int band = 1; band < bands; band++) {
+        workers.push_back(std::thread([&function, &cpu_ms, band, rows, bands]() {
+            function(band, (int)((long long)rows * band / bands), (int)((long long)rows * (band + 1) / bands));
+            cpu_ms[band] = GetThreadCpuMs();
+        }));
+    }
+    function(0, 0, (int)((long long)rows / bands));
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    for (int band = 1; band < bands; band++) worker_cpu_ms += cpu_ms[band];
+    return bands;
+}
+
+//Queue with a maximum number of items shared between pipeline stages. Push blocks while the queue is full (TryPush drops the item instead) and Pop blocks while it is empty.
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1), closed(false) {}
+
+    //Add an item, waiting for room. Returns false if the queue was closed.
+    bool Push(const T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) return false;
+        items.push_back(item);
+        not_empty.notify_one();
+        return true;
+    }
+
+    //Add an item only if there is room, never waits. Returns false if the queue was full or closed.
+    bool TryPush(const T& item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.size() >= capacity || closed) return false;
+        items.push_back(item);
+        not_empty.notify_one();
+        return true;
+    }
+
+    //Take the oldest item, waiting for one. Returns false once the queue is closed and empty.
+    bool Pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    //No more items will be pushed, wakes up all waiting threads.
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+};
+
+/************************
+Look for pixels with values higher or equal to threshold in one row, 16 (AVX2) or 8 (SSE4.1) pixels per compare with scalar code for the rest.
+<row> is the row of 16-bit pixels.
+<width> is the number of pixels in the row.
+<threshold> is the value from 0-65535 (black to white).
+<base> is the linear index of the first pixel of the row.
+<indices> receives the linear index of every hot pixel, in raster order.
+*************************/
+void RowGetHotIndices(const unsigned short* row, int width, unsigned short threshold, unsigned int base, std::vector<unsigned int>& indices) {
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i thr = _mm256_set1_epi16((short)threshold);
+    for (; x + 16 <= width; x += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(row + x));
+        //// v >= threshold as unsigned: max(v, threshold) == v. Two mask bits per pixel, keep the even ones
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_max_epu16(v, thr), v)) & 0x55555555u;
+        while (mask) {
+            indices.push_back(base + x + (CountTrailingZeros(mask) >> 1));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE4_1__)
+    const __m128i thr = _mm_set1_epi16((short)threshold);
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_max_epu16(v, thr), v)) & 0x5555u;
+        while (mask) {
+            indices.push_back(base + x + (CountTrailingZeros(mask) >> 1));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        if (row[x] >= threshold) indices.push_back(base + x);
+    }
+}
+
+/************************
+Look for pixels with values higher or equal to threshold in a decoded image. The image is split in row bands scanned in parallel, each band fills its own list and the lists are joined in band order, so the result is the same for any number of threads.
+<image> is a CV_16UC1 buffer.
+<threshold> is the value from 0-65535 (black to white).
+<indices> receives the linear index (y * width + x) of every hot pixel, in raster order.
+<threads> is the number of row bands scanned in parallel, 0 for all the cores.
+*************************/
+void BufferGetHotIndices(const cv::Mat& image, long threshold, std::vector<unsigned int>& indices, int threads = 1) {
+    indices.clear();
+    if (threshold > 65535) return;
+    unsigned short thr = (unsigned short)std::max(threshold, 0L);
+    std::vector<std::vector<unsigned int> > band_indices(std::max(1, std::min(GetThreadCount(threads), image.rows)));
+    int bands = ParallelBands(image.rows, threads, [&](int band, int first_row, int end_row) {
+        for (int y = first_row; y < end_row; y++) {
+            RowGetHotIndices(image.ptr<unsigned short>(y), image.cols, thr, (unsigned int)y * image.cols, band_indices[band]);
+        }
+    });
+
+    //// Join the bands in row order
+    size_t total = 0;
+    for (int band = 0; band < bands; band++) total += band_indices[band].size();
+    indices.reserve(total);
+    for (int band = 0; band < bands; band++) indices.insert(indices.end(), band_indices[band].begin(), band_indices[band].end());
+}
+
+/************************
+Convert linear pixel indices to point coordinates.
+<indices> are linear indices (y * width + x).
+<width> is the width of the image.
+Returns vector of points in the same order as <indices>.
+*************************/
+std::vector<cv::Point2f> IndicesToPoints(const std::vector<unsigned int>& indices, int width) {
+    std::vector<cv::Point2f> points(indices.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+        points[i] = cv::Point2f((float)(indices[i] % width), (float)(indices[i] / width));
+    }
+    return points;
+}
+
+//Threshold of the hot pixels of HotPixelDetection=0 (ThresholdMode in the config file)
+const int THRESHOLD_FIXED = 0; //MasterThresholdHotPixels
+const int THRESHOLD_PERCENTILE = 1; //ThresholdPercentile of the values of the frame
+const int THRESHOLD_PLATEAU = 2; //lower edge of the saturation mode, the highest mode of the histogram of the frame
+
+const int HISTOGRAM_BINS = 65536; //one bin per 16-bit value
+const int HISTOGRAM_LANES = 4; //interleaved sub-histograms, so consecutive pixels of equal value do not wait on the same counter
+
+/************************
+Add the pixels of one row to a histogram. Pixel x is counted in sub-histogram x % HISTOGRAM_LANES.
+<row> is the row of 16-bit pixels.
+<width> is the number of pixels in the row.
+<histogram> has HISTOGRAM_LANES * HISTOGRAM_BINS counters.
+*************************/
+inline void RowAddToHistogram(const unsigned short* row, int width, unsigned int* histogram) {
+    unsigned int* lane1 = histogram + HISTOGRAM_BINS;
+    unsigned int* lane2 = histogram + 2 * HISTOGRAM_BINS;
+    unsigned int* lane3 = histogram + 3 * HISTOGRAM_BINS;
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        histogram[row[x]]++;
+        lane1[row[x + 1]]++;
+        lane2[row[x + 2]]++;
+        lane3[row[x + 3]]++;
+    }
+    for (; x < width; x++) histogram[row[x]]++;
+}
+
+/************************
+Threshold that leaves at most a number of pixels equal or above it.
+<histogram> has HISTOGRAM_BINS counters.
+<allowed> is the maximum number of pixels equal or above the threshold.
+Returns the lowest value with at most <allowed> pixels equal or above it, the highest value of the histogram if it alone has more than <allowed> pixels (e.g. saturated frames), 65536 if the histogram is empty.
+*************************/
+long HistogramCountThreshold(const std::vector<unsigned long long>& histogram, unsigned long long allowed) {
+    unsigned long long count = 0;
+    long threshold = HISTOGRAM_BINS;
+    for (long value = HISTOGRAM_BINS - 1; value >= 0; value--) {
+        if (count + histogram[value] > allowed) {
+            if (count == 0) threshold = value; //highest value, the threshold cannot be above it
+            break;
+        }
+        count += histogram[value];
+        threshold = value;
+    }
+    return threshold;
+}
+
+/************************
+Threshold that leaves a percentile of the pixels below it.
+<histogram> has HISTOGRAM_BINS counters.
+<total> is the number of pixels of the histogram.
+<percentile> is the percent of pixels below the threshold, 0-100.
+Returns the lowest value with at most (100 - percentile)% of the pixels equal or above it, 65536 if there is none.
+*************************/
+long HistogramPercentileThreshold(const std::vector<unsigned long long>& histogram, unsigned long long total, double percentile) {
+    double above = (100.0 - std::min(std::max(percentile, 0.0), 100.0)) / 100.0 * total;
+    return HistogramCountThreshold(histogram, (unsigned long long)above);
+}
+
+/************************
+Threshold at the lower edge of the saturation mode. The histogram is summed in bins of 256 values and walked down from the highest occupied bin: the highest mode (hot and saturated pixels) ends where the count falls below half of its peak, and the valley that separates it from the signal ends where the count is back to half of the peak.
+<histogram> has HISTOGRAM_BINS counters.
+<floor> is the lowest threshold, the walk stops there.
+Returns the first value above the lowest bin of the valley, or -1 if the mode or the valley reach the floor, so no mode is separated from the signal above it.
+*************************/
+long HistogramPlateauThreshold(const std::vector<unsigned long long>& histogram, long floor) {
+    unsigned long long coarse[256] = {};
+    for (int value = 0; value < HISTOGRAM_BINS; value++) coarse[value >> 8] += histogram[value];
+    int lowest = (int)(std::min(std::max(floor, 0L), 65535L) >> 8);
+    int bin = 255;
+    while (bin > lowest && coarse[bin] == 0) bin--;
+    if (coarse[bin] == 0) return -1; //no pixel above the floor
+
+    //// Highest mode, down to where it falls below half of its peak
+    unsigned long long peak = 0;
+    for (; bin >= lowest && 2 * coarse[bin] >= peak; bin--) peak = std::max(peak, coarse[bin]);
+    if (bin < lowest) return -1;
+
+    //// Valley, down to where the signal is back to half of the peak
+    int valley = bin;
+    for (; bin >= lowest && 2 * coarse[bin] < peak; bin--) {
+        if (coarse[bin] < coarse[valley]) valley = bin;
+    }
+    if (bin < lowest) return -1;
+    return std::max((long)(valley + 1) << 8, floor);
+}
+
+/************************
+Look for hot pixels with a threshold derived from the frame, in a single pass over the image. Each row band fills its own histogram and keeps the pixels equal or above <floor> as candidates; the histograms are merged, the threshold is derived and only the candidates are read again.
+<image> is a CV_16UC1 buffer.
+<mode> is THRESHOLD_PERCENTILE or THRESHOLD_PLATEAU.
+<percentile> is the percentile of THRESHOLD_PERCENTILE, 0-100.
+<floor> is the lowest threshold and the value of the candidates, 0-65535.
+<fallback> is the threshold used when THRESHOLD_PLATEAU finds no saturation mode.
+<indices> receives the linear index (y * width + x) of every hot pixel, in raster order.
+<threshold> receives the threshold derived for the frame.
+<threads> is the number of row bands scanned in parallel, 0 for all the cores.
+*************************/
+void BufferGetAdaptiveHotIndices(const cv::Mat& image, int mode, double percentile, long floor, long fallback, std::vector<unsigned int>& indices, long& threshold, int threads = 1) {
+    indices.clear();
+    unsigned short candidate = (unsigned short)std::min(std::max(floor, 0L), 65535L);
+    int band_count = std::max(1, std::min(GetThreadCount(threads), image.rows));
+    std::vector<std::vector<unsigned int> > band_indices(band_count);
+    std::vector<std::vector<unsigned int> > band_histograms(band_count);
+    int bands = ParallelBands(image.rows, threads, [&](int band, int first_row, int end_row) {
+        std::vector<unsigned int>& histogram = band_histograms[band];
+        histogram.assign(HISTOGRAM_LANES * HISTOGRAM_BINS, 0);
+        for (int y = first_row; y < end_row; y++) {
+            const unsigned short* row = image.ptr<unsigned short>(y);
+            RowAddToHistogram(row, image.cols, &histogram[0]);
+            RowGetHotIndices(row, image.cols, candidate, (unsigned int)y * image.cols, band_indices[band]);
+        }
+    });
+
+    //// Merge the sub-histograms of every band
+    std::vector<unsigned long long> histogram(HISTOGRAM_BINS, 0);
+    for (int band = 0; band < bands; band++) {
+        const unsigned int* counts = &band_histograms[band][0];
+        for (int lane = 0; lane < HISTOGRAM_LANES; lane++) {
+            for (int value = 0; value < HISTOGRAM_BINS; value++) histogram[value] += counts[lane * HISTOGRAM_BINS + value];
+        }
+    }
+    if (mode == THRESHOLD_PLATEAU) {
+        threshold = HistogramPlateauThreshold(histogram, floor);
+        if (threshold < 0) threshold = fallback;
+    }
+    else {
+        threshold = HistogramPercentileThreshold(histogram, image.total(), percentile);
+    }
+    threshold = std::max(threshold, (long)candidate);
+
+    //// Keep the candidates reaching the threshold, joined in band order
+    size_t total = 0;
+    for (int band = 0; band < bands; band++) total += band_indices[band].size();
+    indices.reserve(total);
+    for (int band = 0; band < bands; band++) {
+        const std::vector<unsigned int>& candidates = band_indices[band];
+        for (size_t i = 0; i < candidates.size(); i++) {
+            if (image.ptr<unsigned short>(candidates[i] / image.cols)[candidates[i] % image.cols] >= threshold) indices.push_back(candidates[i]);
+        }
+    }
+}
+
+/************************
+Limit the number of hot pixels, keeping the brightest. Exactly <max_hot> pixels are kept: all the pixels above the lowest value kept, and the first pixels of that value in raster order.
+<image> is the CV_16UC1 buffer of the indices.
+<max_hot> is the maximum number of hot pixels, 0 for no limit.
+<indices> are the linear indices of the hot pixels in raster order, filtered in place.
+Returns the lowest value kept, or -1 if there were no more than <max_hot> pixels.
+*************************/
+long IndicesApplyCap(const cv::Mat& image, size_t max_hot, std::vector<unsigned int>& indices) {
+    if (max_hot == 0 || indices.size() <= max_hot) return -1;
+    std::vector<unsigned long long> histogram(HISTOGRAM_BINS, 0);
+    for (size_t i = 0; i < indices.size(); i++) histogram[image.ptr<unsigned short>(indices[i] / image.cols)[indices[i] % image.cols]]++;
+
+    //// Lowest value kept: fewer than max_hot pixels above it, at least max_hot with it
+    unsigned long long above = 0;
+    long threshold = HISTOGRAM_BINS - 1;
+    for (; threshold > 0 && above + histogram[threshold] < max_hot; threshold--) above += histogram[threshold];
+    size_t ties = max_hot - (size_t)above; //pixels of the lowest value kept
+
+    size_t kept = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        unsigned short value = image.ptr<unsigned short>(indices[i] / image.cols)[indices[i] % image.cols];
+        if (value > threshold || (value == threshold && ties > 0)) {
+            if (value == threshold) ties--;
+            indices[kept++] = indices[i];
+        }
+    }
+    indices.resize(kept);
+    return threshold;
+}
+
+//Hot pixel detection modes (HotPixelDetection in the config file)
+const int DETECT_PIXELS = 0; //every pixel equal or above MasterThresholdHotPixels
+const int DETECT_STREAKS = 1; //connected components with hysteresis, i.e. gamma streaks and their halo
+const int DETECT_TEMPORAL = 2; //outliers against the history of each pixel in a series (see BufferTemporalHotIndices())
+
+//Class to store a run of consecutive hot pixels of a row, the unit of a run-length encoded mask
+class PixelRun {
+public:
+    int y; //row
+    int x0, x1; //first column and the column after the last one
+};
+
+//Order of runs in a mask: by row, then by first column
+inline bool PixelRunLess(const PixelRun& a, const PixelRun& b) {
+    return a.y < b.y || (a.y == b.y && a.x0 < b.x0);
+}
+
+//Root of a run in the union-find forest of BufferGetHotRuns(), with path halving
+inline int RunFindRoot(std::vector<int>& parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/************************
+Grow a run-length encoded mask by a square of <radius> pixels around every pixel.
+<runs> is the mask, sorted by row and column, and receives the grown mask with merged runs.
+<radius> is the number of pixels added on each side.
+<size> is the size of the image, the mask is clipped to it.
+*************************/
+void RunsDilate(std::vector<PixelRun>& runs, int radius, cv::Size size) {
+    if (radius <= 0 || runs.empty()) return;
+    std::vector<PixelRun> grown;
+    grown.reserve(runs.size() * (2 * radius + 1));
+    for (size_t i = 0; i < runs.size(); i++) {
+        for (int y = std::max(runs[i].y - radius, 0); y <= std::min(runs[i].y + radius, size.height - 1); y++) {
+            PixelRun run = { y, std::max(runs[i].x0 - radius, 0), std::min(runs[i].x1 + radius, size.width) };
+            grown.push_back(run);
+        }
+    }
+    std::sort(grown.begin(), grown.end(), PixelRunLess);
+
+    //// Merge overlapping and touching runs of each row
+    runs.clear();
+    for (size_t i = 0; i < grown.size(); i++) {
+        if (!runs.empty() && runs.back().y == grown[i].y && grown[i].x0 <= runs.back().x1) runs.back().x1 = std::max(runs.back().x1, grown[i].x1);
+        else runs.push_back(grown[i]);
+    }
+}
+
+/************************
+Find gamma streaks in a decoded image as connected components (8-connected) of pixels equal or above a low threshold that have at least one pixel equal or above a high threshold.
+Rows are scanned once, the runs of each row are joined with the overlapping runs of the row above in a union-find forest.
+<image> is a CV_16UC1 buffer.
+<low> is the threshold of the pixels of a streak, including its halo.
+<high> is the threshold a streak must reach to be hot (MasterThresholdHotPixels).
+<dilation> is the number of pixels the streaks are grown on each side, 0 for none.
+<runs> receives the run-length encoded mask of the streaks, sorted by row and column.
+*************************/
+void BufferGetHotRuns(const cv::Mat& image, long low, long high, int dilation, std::vector<PixelRun>& runs) {
+    runs.clear();
+    low = std::min(low, high);
+    if (low > 65535) return;
+    unsigned short thr = (unsigned short)std::max(low, 0L);
+    std::vector<unsigned int> indices;
+    std::vector<int> parent;
+    std::vector<unsigned char> strong; //run, or component for roots, reaches the high threshold
+    size_t above_begin = 0, above_end = 0; //runs of the row above
+    for (int y = 0; y < image.rows; y++) {
+        const unsigned short* row = image.ptr<unsigned short>(y);
+        indices.clear();
+        RowGetHotIndices(row, image.cols, thr, 0, indices);
+
+        //// Runs of the row
+        size_t begin = runs.size();
+        for (size_t i = 0; i < indices.size(); i++) {
+            int x = (int)indices[i];
+            if (runs.size() > begin && runs.back().x1 == x) runs.back().x1++;
+            else {
+                PixelRun run = { y, x, x + 1 };
+                runs.push_back(run);
+                parent.push_back((int)parent.size());
+                strong.push_back(0);
+            }
+            if (row[x] >= high) strong.back() = 1;
+        }
+        size_t end = runs.size();
+
+        //// Join with the runs of the row above that touch them, diagonals included
+        size_t a = above_begin;
+        for (size_t r = begin; r < end; r++) {
+            while (a < above_end && runs[a].x1 < runs[r].x0) a++;
+            for (size_t b = a; b < above_end && runs[b].x0 <= runs[r].x1; b++) {
+                int root_r = RunFindRoot(parent, (int)r), root_b = RunFindRoot(parent, (int)b);
+                if (root_r == root_b) continue;
+                if (root_r < root_b) std::swap(root_r, root_b);
+                parent[root_r] = root_b; //older run is the root
+                strong[root_b] |= strong[root_r];
+            }
+        }
+        above_begin = begin;
+        above_end = end;
+    }
+
+    //// Keep the components that reach the high threshold
+    size_t kept = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (strong[RunFindRoot(parent, (int)i)]) runs[kept++] = runs[i];
+    }
+    runs.resize(kept);
+    RunsDilate(runs, dilation, image.size());
+}
+
+/************************
+Count the pixels of a run-length encoded mask.
+<runs> is the mask.
+Returns the number of pixels.
+*************************/
+size_t RunsPixelCount(const std::vector<PixelRun>& runs) {
+    size_t count = 0;
+    for (size_t i = 0; i < runs.size(); i++) count += runs[i].x1 - runs[i].x0;
+    return count;
+}
+
+//Compare a run with a row, used to find the runs of a row band
+inline bool PixelRunRowLess(const PixelRun& run, int y) { return run.y < y; }
+
+/************************
+Take the replacement value of every pixel of a run-length encoded mask. Runs are sampled in chunks of spans, so only the mask and one value per pixel are kept for the whole image.
+<runs> is the mask in master raw coordinates.
+<sample> gives the values of a chunk of master raw points (-1 where there is no value).
+<values> receives the value of every pixel of the mask, run after run (see RunsSetValues()).
+*************************/
+void RunsGetValues(const std::vector<PixelRun>& runs, const std::function<void(const std::vector<cv::Point2f>&, std::vector<int>&)>& sample, std::vector<int>& values) {
+    const size_t chunk = 4096;
+    std::vector<cv::Point2f> points;
+    std::vector<int> chunk_values;
+    points.reserve(chunk);
+    values.clear();
+    values.reserve(RunsPixelCount(runs));
+    for (size_t i = 0; i < runs.size(); i++) {
+        for (int x = runs[i].x0; x < runs[i].x1; x++) points.push_back(cv::Point2f((float)x, (float)runs[i].y));
+        if (points.size() < chunk && i + 1 < runs.size()) continue;
+        sample(points, chunk_values);
+        values.insert(values.end(), chunk_values.begin(), chunk_values.end());
+        points.clear();
+    }
+}
+
+/************************
+Set the values of a run-length encoded mask in a decoded image, one row span per run. With more than one thread each thread writes the runs of one row band of the image.
+<image> is the CV_16UC1 buffer to modify.
+<runs> is the mask, sorted by row and column.
+<values> has the value of every pixel of the mask, run after run (see RunsGetValues()). Negative values are skipped.
+<threads> is the number of row bands written in parallel, 0 for all the cores.
+*************************/
+void RunsSetValues(cv::Mat& image, const std::vector<PixelRun>& runs, const std::vector<int>& values, int threads = 1) {
+    if (values.size() < 4096) threads = 1; //not worth starting threads for a few pixels
+    std::vector<size_t> offsets(runs.size() + 1, 0); //first value of every run
+    for (size_t i = 0; i < runs.size(); i++) offsets[i + 1] = offsets[i] + (runs[i].x1 - runs[i].x0);
+    ParallelBands(image.rows, threads, [&](int, int first_row, int end_row) {
+        size_t r = std::lower_bound(runs.begin(), runs.end(), first_row, PixelRunRowLess) - runs.begin();
+        size_t end = std::lower_bound(runs.begin() + r, runs.end(), end_row, PixelRunRowLess) - runs.begin();
+        for (; r < end; r++) {
+            const PixelRun& run = runs[r];
+            unsigned short* row = image.ptr<unsigned short>(run.y);
+            const int* value = values.data() + offsets[r];
+            for (int x = std::max(run.x0, 0); x < std::min(run.x1, image.cols); x++) {
+                if (value[x - run.x0] >= 0) row[x] = (unsigned short)value[x - run.x0];
+            }
+        }
+    });
+}
+
+/************************
+Add the pixels of a run-length encoded mask to a list of corrections, for the writers that take one coordinate per pixel (sidecar, patched file copies, diagnostics).
+<runs> is the mask, sorted by row and column.
+<values> has the value of every pixel of the mask, run after run (see RunsGetValues()).
+<corrections> is sorted by row and receives the pixels of the mask, still sorted by row.
+*************************/
+void RunsAddCorrections(const std::vector<PixelRun>& runs, const std::vector<int>& values, std::vector<Coords>& corrections) {
+    size_t before = corrections.size(), k = 0;
+    corrections.reserve(before + values.size());
+    for (size_t i = 0; i < runs.size(); i++) {
+        for (int x = runs[i].x0; x < runs[i].x1; x++, k++) {
+            Coords c = { x, runs[i].y, values[k] };
+            corrections.push_back(c);
+        }
+    }
+    std::inplace_merge(corrections.begin(), corrections.begin() + before, corrections.end(), [](const Coords& a, const Coords& b) { return a.y < b.y; });
+}
+
+/************************
+***** TEMPORAL DETECTION *****
+Gamma hits last one frame, bright features of the sample last many. With HotPixelDetection=2 each pixel of a series is compared with its own history: exponentially weighted mean and variance of the last TemporalWindow frames, updated in place with every frame.
+*************************/
+
+//Minimum variance used by the temporal test, so pixels with a flat history are not flagged by one count of noise
+const float TEMPORAL_MIN_VARIANCE = 1.0f;
+
+//Consecutive frames a pixel is an outlier before its new level is added to its history: gamma hits last one frame, a sample feature moving in or a longer exposure last many
+const int TEMPORAL_PERSISTENCE = 3;
+
+//Class to store the per-pixel statistics of a frame series, one plane per statistic (structure of arrays)
+class TemporalStats {
+public:
+    cv::Size size; //size of the frames
+    std::vector<float> mean, variance; //weighted mean and variance of every pixel
+    std::vector<unsigned short> samples; //frames in the history of every pixel, up to the window
+    std::vector<unsigned char> hits; //consecutive frames every pixel was left out of its history
+    int frames; //number of frames accumulated
+
+    TemporalStats() : frames(0) {}
+};
+
+/************************
+Update the statistics of a row with a new frame and find its outliers.
+A pixel is hot if it is equal or above <threshold>, or if it has <window> frames of history and it is above its mean by more than z standard deviations.
+Outliers are not added to the history, nor are pixels equal or above <threshold> while the history is filled, unless they were left out of it the last TEMPORAL_PERSISTENCE - 1 frames too (the level of the pixel changed).
+Each pixel has its own number of frames, the new frame has weight 1 / (frames + 1) up to 1 / <window>.
+<row> is the row of the new frame.
+<mean>, <variance>, <samples> and <hits> are the statistics of the row, updated in place.
+<width> is the number of pixels.
+<window> is the number of frames of the history.
+<z2> is the square of the z threshold.
+<threshold> is the value a pixel is always hot from (MasterThresholdHotPixels).
+<base> is added to every index (index of the first pixel of the row in the image).
+<indices> receives the indices of the hot pixels, in increasing order.
+*************************/
+void RowTemporalUpdate(const unsigned short* row, float* mean, float* variance, unsigned short* samples, unsigned char* hits, int width, int window, float z2, float threshold, unsigned int base, std::vector<unsigned int>& indices) {
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256 z = _mm256_set1_ps(z2), thr = _mm256_set1_ps(threshold), one = _mm256_set1_ps(1.0f), full = _mm256_set1_ps((float)window);
+    const __m256 minvar = _mm256_set1_ps(TEMPORAL_MIN_VARIANCE), zero = _mm256_setzero_ps(), persist = _mm256_set1_ps((float)(TEMPORAL_PERSISTENCE - 1)), maxhits = _mm256_set1_ps(255.0f);
+    alignas(32) int count[8], left[8];
+    for (; x + 8 <= width; x += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row + x))));
+        __m256 n = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(samples + x))));
+        __m256 h = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(hits + x))));
+        __m256 m = _mm256_loadu_ps(mean + x), s = _mm256_loadu_ps(variance + x);
+        __m256 d = _mm256_sub_ps(v, m), d2 = _mm256_mul_ps(d, d);
+        __m256 a = _mm256_div_ps(one, _mm256_add_ps(_mm256_min_ps(n, _mm256_sub_ps(full, one)), one));
+        __m256 detect = _mm256_cmp_ps(n, full, _CMP_GE_OQ);
+        __m256 outlier = _mm256_and_ps(detect, _mm256_and_ps(_mm256_cmp_ps(d, zero, _CMP_GT_OQ), _mm256_cmp_ps(d2, _mm256_mul_ps(z, _mm256_max_ps(s, minvar)), _CMP_GT_OQ)));
+        __m256 saturated = _mm256_cmp_ps(v, thr, _CMP_GE_OQ);
+        __m256 excluded = _mm256_or_ps(outlier, _mm256_andnot_ps(detect, saturated));
+        __m256 skip = _mm256_andnot_ps(_mm256_cmp_ps(h, persist, _CMP_GE_OQ), excluded);
+        _mm256_storeu_ps(mean + x, _mm256_blendv_ps(_mm256_add_ps(m, _mm256_mul_ps(a, d)), m, skip));
+        _mm256_storeu_ps(variance + x, _mm256_blendv_ps(_mm256_mul_ps(_mm256_sub_ps(one, a), _mm256_add_ps(s, _mm256_mul_ps(a, d2))), s, skip));
+        _mm256_store_si256((__m256i*)count, _mm256_cvtps_epi32(_mm256_blendv_ps(_mm256_min_ps(_mm256_add_ps(n, one), full), n, skip)));
+        _mm256_store_si256((__m256i*)left, _mm256_cvtps_epi32(_mm256_and_ps(excluded, _mm256_min_ps(_mm256_add_ps(h, one), maxhits))));
+        for (int k = 0; k < 8; k++) {
+            samples[x + k] = (unsigned short)count[k];
+            hits[x + k] = (unsigned char)left[k];
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_or_ps(outlier, saturated));
+        while (mask) {
+            indices.push_back(base + x + CountTrailingZeros(mask));
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE4_1__)
+    const __m128 z = _mm_set1_ps(z2), thr = _mm_set1_ps(threshold), one = _mm_set1_ps(1.0f), full = _mm_set1_ps((float)window);
+    const __m128 minvar = _mm_set1_ps(TEMPORAL_MIN_VARIANCE), zero = _mm_setzero_ps(), persist = _mm_set1_ps((float)(TEMPORAL_PERSISTENCE - 1)), maxhits = _mm_set1_ps(255.0f);
+    alignas(16) int count[4], left[4];
+    for (; x + 4 <= width; x += 4) {
+        int packed_hits;
+        memcpy(&packed_hits, hits + x, sizeof(packed_hits));
+        __m128 v = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(row + x))));
+        __m128 n = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(samples + x))));
+        __m128 h = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed_hits)));
+        __m128 m = _mm_loadu_ps(mean + x), s = _mm_loadu_ps(variance + x);
+        __m128 d = _mm_sub_ps(v, m), d2 = _mm_mul_ps(d, d);
+        __m128 a = _mm_div_ps(one, _mm_add_ps(_mm_min_ps(n, _mm_sub_ps(full, one)), one));
+        __m128 detect = _mm_cmpge_ps(n, full);
+        __m128 outlier = _mm_and_ps(detect, _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_cmpgt_ps(d2, _mm_mul_ps(z, _mm_max_ps(s, minvar)))));
+        __m128 saturated = _mm_cmpge_ps(v, thr);
+        __m128 excluded = _mm_or_ps(outlier, _mm_andnot_ps(detect, saturated));
+        __m128 skip = _mm_andnot_ps(_mm_cmpge_ps(h, persist), excluded);
+        _mm_storeu_ps(mean + x, _mm_blendv_ps(_mm_add_ps(m, _mm_mul_ps(a, d)), m, skip));
+        _mm_storeu_ps(variance + x, _mm_blendv_ps(_mm_mul_ps(_mm_sub_ps(one, a), _mm_add_ps(s, _mm_mul_ps(a, d2))), s, skip));
+        _mm_store_si128((__m128i*)count, _mm_cvtps_epi32(_mm_blendv_ps(_mm_min_ps(_mm_add_ps(n, one), full), n, skip)));
+        _mm_store_si128((__m128i*)left, _mm_cvtps_epi32(_mm_and_ps(excluded, _mm_min_ps(_mm_add_ps(h, one), maxhits))));
+        for (int k = 0; k < 4; k++) {
+            samples[x + k] = (unsigned short)count[k];
+            hits[x + k] = (unsigned char)left[k];
+        }
+        unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_or_ps(outlier, saturated));
+        while (mask) {
+            indices.push_back(base + x + CountTrailingZeros(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        float v = row[x], d = v - mean[x], d2 = d * d;
+        float a = 1.0f / (std::min((int)samples[x], window - 1) + 1);
+        bool detect = samples[x] >= window;
+        bool outlier = detect && d > 0.0f && d2 > z2 * std::max(variance[x], TEMPORAL_MIN_VARIANCE);
+        bool saturated = v >= threshold;
+        bool excluded = outlier || (!detect && saturated);
+        if (outlier || saturated) indices.push_back(base + x);
+        bool skip = excluded && hits[x] < TEMPORAL_PERSISTENCE - 1;
+        hits[x] = excluded ? (unsigned char)std::min(hits[x] + 1, 255) : 0;
+        if (skip) continue;
+        mean[x] += a * d;
+        variance[x] = (1.0f - a) * (variance[x] + a * d2);
+        samples[x] = (unsigned short)std::min((int)samples[x] + 1, window);
+    }
+}
+
+/************************
+Find hot pixels of a frame of a series against the history of every pixel, and add the frame to the history.
+The first <window> frames of every pixel are added with equal weights (running mean and variance) and only pixels equal or above <threshold> are hot, later frames have weight 1/<window>.
+<image> is the CV_16UC1 buffer of the frame. Frames must come in acquisition order.
+<stats> is the history, it is reset if the frame size changes.
+<window> is the number of frames of the history (TemporalWindow).
+<z> is the number of standard deviations above the mean of an outlier (TemporalZThreshold).
+<threshold> is the value a pixel is always hot from (MasterThresholdHotPixels).
+<indices> receives the indices of hot pixels in raster order.
+<threads> is the number of row bands processed in parallel, 0 for all the cores.
+*************************/
+void BufferTemporalHotIndices(const cv::Mat& image, TemporalStats& stats, int window, double z, long threshold, std::vector<unsigned int>& indices, int threads = 1) {
+    indices.clear();
+    window = std::min(std::max(window, 2), 65535);
+    if (stats.size != image.size()) {
+        size_t pixels = (size_t)image.rows * image.cols;
+        stats.size = image.size();
+        stats.mean.assign(pixels, 0.0f);
+        stats.variance.assign(pixels, 0.0f);
+        stats.samples.assign(pixels, 0);
+        stats.hits.assign(pixels, 0);
+        stats.frames = 0;
+    }
+    float z2 = (float)(z * z);
+    std::vector<std::vector<unsigned int> > band_indices(std::max(1, std::min(GetThreadCount(threads), image.rows)));
+    int bands = ParallelBands(image.rows, threads, [&](int band, int first_row, int end_row) {
+        for (int y = first_row; y < end_row; y++) {
+            size_t offset = (size_t)y * image.cols;
+            RowTemporalUpdate(image.ptr<unsigned short>(y), &stats.mean[offset], &stats.variance[offset], &stats.samples[offset], &stats.hits[offset], image.cols, window, z2, (float)threshold, (unsigned int)offset, band_indices[band]);
+        }
+    });
+    stats.frames++;
+
+    //// Join the bands in row order
+    for (int band = 0; band < bands; band++) indices.insert(indices.end(), band_indices[band].begin(), band_indices[band].end());
+}
+
+/************************
+***** FITS IMAGES *****
+Read 16-bit FITS images (BITPIX = 16) straight from the mapped file into the 16-bit buffer, and write the corrected master as a copy of the input with only the corrected pixels changed, so the header and any extension are kept as they are.
+Rows are flipped as ImageMagick does, the first row of the FITS data unit is the last row of the buffer.
+*************************/
+
+//Size of a FITS block and of a header card, in bytes
+const size_t FITS_BLOCK = 2880;
+const size_t FITS_CARD = 80;
+
+//Class to store the layout of the primary image of a FITS file
+class FitsHeader {
+public:
+    int bitpix; //BITPIX, bits per value (negative for floating point)
+    int width, height; //NAXIS1 and NAXIS2
+    double bzero, bscale; //physical value = BZERO + BSCALE * stored value
+    size_t data_offset; //position of the data unit in the file
+
+    FitsHeader() : bitpix(0), width(0), height(0), bzero(0.0), bscale(1.0), data_offset(0) {}
+
+    //Stored values are offset binary (BZERO = 32768), the usual way to store unsigned 16-bit values. Otherwise they are signed (BZERO = 0)
+    bool Unsigned() const { return bzero == 32768.0; }
+};
+
+/************************
+Check if a file name has a FITS extension (.fit, .fits or .fts).
+<filename> is the file name.
+Returns true for FITS file names.
+*************************/
+bool IsFitsFile(std::string filename) {
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    std::string extension = filename.substr(dot + 1);
+    for (size_t i = 0; i < extension.size(); i++) extension[i] = (char)tolower(extension[i]);
+    return extension == "fit" || extension == "fits" || extension == "fts";
+}
+
+/************************
+Parse the primary header of a FITS file.
+<data> and <size> are the mapped file.
+<header> receives the layout of the primary image.
+Returns true if the primary image is a 2D image of 16-bit values with BSCALE = 1 and BZERO = 0 or 32768, the only format read directly (other formats go through ImageMagick).
+*************************/
+bool FitsReadHeader(const unsigned char* data, size_t size, FitsHeader& header) {
+    if (size < FITS_BLOCK || memcmp(data, "SIMPLE  =", 9) != 0) return false;
+    int naxis = -1, naxis3 = 1;
+    for (size_t card = 0; card + FITS_CARD <= size; card += FITS_CARD) {
+        std::string keyword((const char*)data + card, 8);
+        keyword.erase(keyword.find_last_not_of(' ') + 1);
+        if (keyword == "END") {
+            header.data_offset = (card + FITS_CARD + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+            return header.bitpix == 16 && (naxis == 2 || (naxis == 3 && naxis3 == 1)) && header.width > 0 && header.height > 0 &&
+                   header.bscale == 1.0 && (header.bzero == 0.0 || header.bzero == 32768.0) &&
+                   header.data_offset + (size_t)header.width * header.height * sizeof(unsigned short) <= size;
+        }
+        if (memcmp(data + card + 8, "= ", 2) != 0) continue;
+        std::string value((const char*)data + card + 10, FITS_CARD - 10);
+        if (keyword == "BITPIX") header.bitpix = atoi(value.c_str());
+        else if (keyword == "NAXIS") naxis = atoi(value.c_str());
+        else if (keyword == "NAXIS1") header.width = atoi(value.c_str());
+        else if (keyword == "NAXIS2") header.height = atoi(value.c_str());
+        else if (keyword == "NAXIS3") naxis3 = atoi(value.c_str());
+        else if (keyword == "BZERO") header.bzero = atof(value.c_str());
+        else if (keyword == "BSCALE") header.bscale = atof(value.c_str());
+    }
+    return false; //no END card
+}
+
+/************************
+Convert a row of big-endian FITS values to 16-bit values, with SSSE3/AVX2 byte shuffles.
+<src> is the row in the FITS data unit.
+<dst> receives width values.
+<width> is the number of values.
+<offset_binary> is true for BZERO = 32768 (the sign bit is flipped), false for BZERO = 0 (negative values are set to 0).
+*************************/
+void RowFitsToBuffer(const unsigned char* src, unsigned short* dst, int width, bool offset_binary) {
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m256i sign = _mm256_set1_epi16((short)0x8000), zero = _mm256_setzero_si256();
+    for (; x + 16 <= width; x += 16) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + 2 * x)), swap);
+        v = offset_binary ? _mm256_xor_si256(v, sign) : _mm256_max_epi16(v, zero);
+        _mm256_storeu_si256((__m256i*)(dst + x), v);
+    }
+#elif defined(__SSE4_1__)
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128i sign = _mm_set1_epi16((short)0x8000), zero = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 2 * x)), swap);
+        v = offset_binary ? _mm_xor_si128(v, sign) : _mm_max_epi16(v, zero);
+        _mm_storeu_si128((__m128i*)(dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        unsigned short v = (unsigned short)((src[2 * x] << 8) | src[2 * x + 1]);
+        dst[x] = offset_binary ? (unsigned short)(v ^ 0x8000) : ((short)v < 0 ? 0 : v);
+    }
+}
+
+/************************
+Open a 16-bit FITS image and convert its primary image into a 16-bit grayscale buffer in one pass over the mapped file.
+<image_name> is the FITS image.
+<image> is where the CV_16UC1 buffer is stored.
+<threads> is the number of row bands converted in parallel, 0 for all the cores.
+Returns true if the image was read, false if it is not a FITS file or its format needs ImageMagick (see FitsReadHeader()).
+*************************/
+bool FitsLoad(std::string image_name, cv::Mat& image, int threads = 1) {
+    MappedFile file;
+    FitsHeader header;
+    if (!file.Open(image_name, false) || !FitsReadHeader(file.data, file.size, header)) return false;
+    image.create(header.height, header.width, CV_16UC1);
+    const unsigned char* pixels = file.data + header.data_offset;
+    size_t row_bytes = (size_t)header.width * sizeof(unsigned short);
+    ParallelBands(header.height, threads, [&](int band, int first_row, int end_row) {
+        for (int y = first_row; y < end_row; y++) {
+            RowFitsToBuffer(pixels + (size_t)(header.height - 1 - y) * row_bytes, image.ptr<unsigned short>(y), header.width, header.Unsigned());
+        }
+    });
+    LogLine(LOG_INFO) << "Opening FITS file: " << image_name << "... OK!";
+    return true;
+}
+
+/************************
+Write the corrected master as a copy of the input FITS file with only the corrected pixels changed, keeping the header and the extensions.
+<infilename> is a FITS image read by FitsLoad().
+<outfilename> is the corrected image.
+<coordinates> has the coordinates and value of the pixels to set. Coordinates with negative value are skipped.
+Returns true if execution was correct.
+*************************/
+bool FitsPatchCopy(std::string infilename, std::string outfilename, const std::vector<Coords>& coordinates) {
+    MappedFile input, output;
+    FitsHeader header;
+    if (!input.Open(infilename, false) || !FitsReadHeader(input.data, input.size, header)) {
+        LogLine(LOG_ERROR) << "Couldn't read FITS header of " << infilename << ".";
+        return false;
+    }
+
+    //// Copy the file as it is, then set the values in the mapped copy
+    FILE* file = fopen(outfilename.c_str(), "wb");
+    bool ok = file && fwrite(input.data, 1, input.size, file) == input.size;
+    if (file && fclose(file) != 0) ok = false;
+    ok = ok && output.Open(outfilename, true);
+    if (ok) {
+        unsigned char* pixels = output.data + header.data_offset;
+        for (size_t i = 0; i < coordinates.size(); i++) {
+            const Coords& c = coordinates[i];
+            if (c.v < 0 || c.x < 0 || c.y < 0 || c.x >= header.width || c.y >= header.height) continue;
+            unsigned short v = header.Unsigned() ? (unsigned short)(c.v ^ 0x8000) : (unsigned short)std::min(c.v, 32767);
+            unsigned char* p = pixels + ((size_t)(header.height - 1 - c.y) * header.width + c.x) * sizeof(unsigned short);
+            p[0] = (unsigned char)(v >> 8);
+            p[1] = (unsigned char)(v & 0xFF);
+        }
+    }
+    output.Close();
+    if (ok) LogLine(LOG_INFO) << "wrote final file in " << outfilename << "... DONE.";
+    else LogLine(LOG_ERROR) << "Couldn't write output file " << outfilename << ".";
+    return ok;
+}
+
+/************************
+Open image and look for pixel coordinates with values higher or equal to threshold. 
+<image_name is a grayscale image file. 
+<threshold> is the value from 0-65535 (black to white).
+Returnds vector of points containing coordinates of points with value above or equal to threshold.
+*************************/
+std::vector<cv::Point2f> ImageGetHotPoints(std::string image_name, long threshold) {
+
+    std::cout << "FIND HOT PIXELS IN " + image_name << std::endl;
+
+    //// Create a wand 
+    MagickWand* mw = NULL;
+    MagickWandGenesis();
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+
+    //// Open image
+    std::cout << "Opening file: " << image_name << " to get bad pixel values... ";
+    if (!MagickReadImage(mw, image_name.c_str())) {
         std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
         exit(0);
     }
-    std::cout << "OK!" << std::endl;
+    else {
+        std::cout << "OK!" << std::endl;
+    }
 
-    /////Draw circle in points
-    std::string label;
-    cv::Point2i shifted;
-    std::cout << "Drawing circles... ";
+    //// Export the pixels to a 16-bit buffer and scan it
+    size_t width = MagickGetImageWidth(mw);
+    size_t height = MagickGetImageHeight(mw);
+    cv::Mat input((int)height, (int)width, CV_16UC1);
+    MagickExportImagePixels(mw, 0, 0, width, height, "I", ShortPixel, input.data);
+    mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+
+    std::cout << "Looking for hot pixels with value >="<<threshold<<"... ";
+    std::vector<unsigned int> indices;
+    BufferGetHotIndices(input, threshold, indices);
+    std::vector<cv::Point2f> hotpoints = IndicesToPoints(indices, (int)width);
+    std::cout << hotpoints.size() << " found!" << std::endl;
+
+    std::cout << std::endl;
+    return hotpoints;
+}
+
+
+/************************
+Transform image to rotate and compensate perspective distortion. 
+<image_type> is either "Slave" or "Master". 
+<image_name> image file name to work with. 
+<config_parameters> contains the table of pixel coordinates as text file x y per row. It is generated with GetConfigFile().
+Returns true if execution was correct.
+*************************/
+bool ImageRotateAndPerspectiveTransformation(std::string image_type, std::string image_name, const std::vector<ConfigParameters>& config_parameters) {
+
+    std::cout << "TRANSFORMATION OF " + image_type + " IMAGE" << std::endl;
+
+    /////Input and Output Image matrices;
+    cv::Mat input, output, output2;
+
+    /////Load the image
+    std::cout << "Open file: " + image_name + "... ";
+    if (!FitsLoad(image_name, input)) input = cv::imread(image_name.c_str(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+    if (input.empty()) {
+        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
+        exit(0);
+    }
+    std::cout << "OK!" << std::endl;
+
+    //////ROTATION AND PERSPECTIVE TRANSFORMATION IN ONE PASS//////
+    std::cout << "Rotating " + image_type + " image with " << GetParameterValueFromConfig(config_parameters, image_type + "Rotation") << " degrees and applying Perspective Transformation... ";
+    cv::Mat matrix = GetRotationAndPerspectiveMatrix(image_type, config_parameters);
+    warpPerspective(input, output2, matrix, input.size());
+    std::cout << "OK!" << std::endl;
+
+    /////Optionally save rotated image with circles in the source points, used to pick the registration points
+    if (GetParameterValueFromConfig(config_parameters, "SaveRotatedImages") != 0) {
+        cv::Point2f src[4], dst[4];
+        GetQuadPointsFromConfig(image_type, config_parameters, src, dst);
+        cv::Point origin = cv::Point(0, 0); //origin point set to 0,0 because rotations between images are calculated from there
+        cv::Mat rotmat = getRotationMatrix2D(origin, GetParameterValueFromConfig(config_parameters, image_type + "Rotation"), 1);
+        warpAffine(input, output, rotmat, input.size());
+        for (int i = 0; i < 4; i++) {
+            cv::circle(output, src[i], 15, cv::Scalar(0, 0, 0), 5, 1);
+        }
+        cv::imwrite(image_type + "Rotated.tif", output);
+    }
+
+     /////Save final image
+    cv::imwrite(image_type + "Final.tif", output2);
+    std::cout << "OK!" << std::endl;
+
+    std::cout << std::endl;
+    return true;
+}
+
+/************************
+Transform points of coordinates of pixels to rotate and compensate perspective distortion. 
+<image_type> is either "Slave" or "Master". 
+<hotpoints> is the input vector of point2f points to be transformed. It is generated with GetConfigFile().
+Returns vector of integer points transformed.
+*************************/
+std::vector<cv::Point2i> PointsRotateAndPerspectiveTransformation(std::string image_type, const std::vector<cv::Point2f>& hotpoints, const std::vector<ConfigParameters>& config_parameters) {
+
+    std::cout << "TRANSFORMATION OF HOTPOINTS/" << std::endl;
+
+    //////ROTATION AND PERSPECTIVE TRANSFORMATION IN ONE PASS//////
+    std::cout << "Rotating " + image_type + " raw image hotpoints " << GetParameterValueFromConfig(config_parameters, image_type + "Rotation") << " degrees and applying Perspective Transformation... ";
+    cv::Mat matrix = GetRotationAndPerspectiveMatrix(image_type, config_parameters);
+    std::vector<cv::Point2f> finalpoints;
+    if (!hotpoints.empty()) perspectiveTransform(hotpoints, finalpoints, matrix);
+    std::cout << "OK!" << std::endl;
+
+  /////Return vector of integer points rounded.
+    std::vector<cv::Point2i> dummy;
+    for (int i = 0; i < finalpoints.size(); i++) {
+        dummy.push_back(finalpoints[i]);
+    }
+
+    std::cout << std::endl;
+    return dummy;
+}
+
+/************************
+Adjusts Brightness and Constrast of an image. 
+<image_name> contains the image path. 
+<brightness> is a value in percent -100 to 100. 
+<contrast> is a value in percent -100 to 100.
+Returns true if the execution was correct.
+*************************/
+bool ImageAdjustBrightnessContrast(std::string image_name, std::string output_name, double brightness, double contrast) {
+    std::cout << "ADJUST CONTRAST IN " + image_name << std::endl;
+    //// Create a wand 
+    MagickWand* mw = NULL;
+    MagickWandGenesis();
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+
+    //// Open image
+    std::cout << "Opening file: " << image_name << " to adjust brightness and contrast... ";
+    if (!MagickReadImage(mw, image_name.c_str())) {
+        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
+        exit(0);
+    }
+    else {
+        std::cout << "OK!" << std::endl;
+    }
+
+    std::cout << "Adjusting Brightness " << brightness << "% and contrast " << contrast << "%... ";
+    MagickBrightnessContrastImage(mw, brightness, contrast);
+    MagickWriteImage(mw, output_name.c_str());
+    std::cout << "OK!" << std::endl;
+
+    mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+    std::cout << std::endl;
+    return true;
+}
+
+/************************
+Draw circles around points for easy visualization of the pixels to be transformed. 
+<image_name> contains the image path. 
+<points> is a std::vector<cv::Point2i> of points to draw.
+Returns true if the execution was correct.
+*************************/
+bool ImageDrawCirclesAroundPoints(std::string image_name, const std::vector<cv::Point2i>& points) {
+    std::cout << "DRAWING CIRCLES IN IMAGE " + image_name << std::endl;
+
+    /////Input and Output Image matrices;
+    cv::Mat input;
+
+    /////Load the image
+    std::cout << "Open file: " + image_name + "... ";
+    if (!FitsLoad(image_name, input)) input = cv::imread(image_name.c_str(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+    if (input.empty()) {
+        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
+        exit(0);
+    }
+    std::cout << "OK!" << std::endl;
+
+    /////Draw circle in points
+    std::string label;
+    cv::Point2i shifted;
+    std::cout << "Drawing circles... ";
     for (int i = 0; i < points.size(); i++) {
         //std::cout<<points[i]<<std::endl;
         cv::circle(input, points[i], 15, 0, 5, 1);
@@ -506,247 +1835,2709 @@ bool ImageDrawCirclesAroundPoints(std::string image_name, const std::vector<cv::
             1); // Anti-alias (Optional, see version note)
     }
 
-    /////Save file
-    std::string dummy = image_name.erase(image_name.length() - 4);
-    cv::imwrite(dummy + "WithCircles.tif", input);
-    std::cout << "OK!" << std::endl;
+    /////Save file
+    std::string dummy = image_name.erase(image_name.length() - 4);
+    cv::imwrite(dummy + "WithCircles.tif", input);
+    std::cout << "OK!" << std::endl;
+
+    std::cout << std::endl;
+    return true;
+}
+
+/************************
+Transform image to rotate and compensate perspective distortion. 
+<image_type> is either "Slave" or "Master". 
+<image_name> image file name to work with. 
+<config_parameters> contains the table of pixel coordinates as text file x y per row (points are top-left x-y, top-right x-y, bottom-left x-y, bottom-right x-y). It is generated with GetConfigFile().
+Returns true if the execution was correct.
+*************************/
+bool RotateAndPerspectiveCorrectionMW(std::string image_type, std::string image_name, const std::vector<ConfigParameters>& config_parameters) {
+    double persp_points[16];
+    GetPerspectivePointsFromConfig(config_parameters, persp_points, image_type);
+
+    MagickWand* mw = NULL;
+    MagickWandGenesis();
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+    if (!MagickReadImage(mw, image_name.c_str())) {
+        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
+        exit(0);
+    }
+
+    //Rotate image
+    double rotation = GetParameterValueFromConfig(config_parameters, image_type + "Rotation");
+    PixelWand* fill = NULL;
+    /* Pixel and drawing wands */
+    fill = NewPixelWand();
+    // Set the fill to "black" for background pixels
+    PixelSetColor(fill, "black");
+    std::cout << "Rotate " << image_type << " image " << rotation << " degrees... " << std::endl;
+    MagickRotateImage(mw, fill, rotation);
+    //Crop image after rotation
+    MagickCropImage(mw, persp_points[14] + 1, persp_points[15] + 1, 0, 0);
+    std::cout << "OK!" << std::endl;
+
+    //Distort image to correct for perspective
+    std::cout << "Perspective Correction for " << image_type << " image... " << std::endl;
+    MagickDistortImage(mw, PerspectiveDistortion, 16, (const double*)&persp_points, MagickFalse);
+    std::string dummy = image_type + "Out.tif";
+    MagickWriteImage(mw, dummy.c_str());
+    std::cout << "OK!" << std::endl;
+    //cleaning
+    if (mw)mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+
+    return true;
+}
+
+/************************
+Open image and resize. 
+<filename> is the input file. 
+<width> is the size in percentage for the ouptut image width. 
+<height> is the size in percentage for the output image height.
+Returns true if execution was correct.
+*************************/
+bool ResizeImage(std::string filename, std::string outfile, int perc_width, int perc_height) {
+    std::cout << "Resizing image: " << filename << " to " << perc_width << "% width and " << perc_height << "% height... ";
+    MagickWand* mw = NULL;
+    int w, h;
+    MagickWandGenesis();
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+    if (!MagickReadImage(mw, filename.c_str())) {
+        std::cerr << std::endl << "Couldn't open " << filename << " original image from SlaveCam... Aborting." << std::endl;
+        exit(0);
+    }
+
+    // Get the image's width and height
+    w = MagickGetImageWidth(mw);
+    h = MagickGetImageHeight(mw);
+    // Scale image
+    w = w * perc_width / 100;
+    h = h * perc_height / 100;
+
+    // Resize the image using the Lanczos filter
+    // The blur factor is a "double", where > 1 is blurry, < 1 is sharp
+    // I haven't figured out how you would change the blur parameter of MagickResizeImage on the command line so I have set it to its default of one.
+    MagickResizeImage(mw, w, h, LanczosFilter, 1);
+
+    // Write the new image
+    if (MagickWriteImage(mw, outfile.c_str())) std::cout << "Saved scaled imaged as " << outfile << "... DONE." << std::endl;
+
+    //clean up
+    if (mw)mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+    return true;
+}
+
+//Number of entries of a lookup table of 16-bit values
+const int LUT_SIZE = 65536;
+
+//Interpolation used to read values at sub-pixel coordinates (SlaveInterpolation in the config file)
+const int SAMPLE_NEAREST = 0;
+const int SAMPLE_BILINEAR = 1;
+const int SAMPLE_BICUBIC = 2;
+
+/************************
+Weights of the 4 taps of the cubic convolution kernel (a = -0.75, same as OpenCV INTER_CUBIC).
+<f> is the fractional part of the coordinate, 0 to 1.
+<w> receives the weights of the taps at -1, 0, 1 and 2.
+*************************/
+inline void CubicWeights(float f, float w[4]) {
+    const float A = -0.75f;
+    w[0] = ((A * (f + 1) - 5 * A) * (f + 1) + 8 * A) * (f + 1) - 4 * A;
+    w[1] = ((A + 2) * f - (A + 3)) * f * f + 1;
+    w[2] = ((A + 2) * (1 - f) - (A + 3)) * (1 - f) * (1 - f) + 1;
+    w[3] = 1 - w[0] - w[1] - w[2];
+}
+
+/************************
+Read the value of one point of a decoded image. Taps outside the image are replaced by the closest pixel of the border.
+<image> is the CV_16UC1 buffer.
+<x> and <y> are the point coordinates, pixel centers at integer values.
+<interpolation> is SAMPLE_NEAREST, SAMPLE_BILINEAR or SAMPLE_BICUBIC.
+Returns the rounded value, or -1 if the point is outside the image (x or y below -0.5 or from width-0.5 or height-0.5).
+*************************/
+inline int BufferSampleValue(const cv::Mat& image, float x, float y, int interpolation) {
+    if (!(x >= -0.5f && y >= -0.5f && x < image.cols - 0.5f && y < image.rows - 0.5f)) return -1;
+    if (interpolation == SAMPLE_NEAREST) {
+        return image.ptr<unsigned short>(std::min(cvRound(y), image.rows - 1))[std::min(cvRound(x), image.cols - 1)];
+    }
+    int x0 = cvFloor(x), y0 = cvFloor(y);
+    float fx = x - x0, fy = y - y0;
+    if (interpolation == SAMPLE_BILINEAR) {
+        const unsigned short* r0 = image.ptr<unsigned short>(std::max(y0, 0));
+        const unsigned short* r1 = image.ptr<unsigned short>(std::min(y0 + 1, image.rows - 1));
+        int c0 = std::max(x0, 0), c1 = std::min(x0 + 1, image.cols - 1);
+        float top = r0[c0] + fx * (r0[c1] - r0[c0]);
+        float bottom = r1[c0] + fx * (r1[c1] - r1[c0]);
+        return cvRound(top + fy * (bottom - top));
+    }
+
+    //// Bicubic with 4x4 taps
+    float wx[4], wy[4];
+    CubicWeights(fx, wx);
+    CubicWeights(fy, wy);
+    int cols[4];
+    for (int k = 0; k < 4; k++) cols[k] = std::min(std::max(x0 - 1 + k, 0), image.cols - 1);
+    float sum = 0;
+    for (int j = 0; j < 4; j++) {
+        const unsigned short* r = image.ptr<unsigned short>(std::min(std::max(y0 - 1 + j, 0), image.rows - 1));
+        sum += wy[j] * (wx[0] * r[cols[0]] + wx[1] * r[cols[1]] + wx[2] * r[cols[2]] + wx[3] * r[cols[3]]);
+    }
+    return std::min(std::max(cvRound(sum), 0), 65535);
+}
+
+/************************
+Read values of a batch of points from a decoded image at sub-pixel coordinates, with no allocation per point. Bilinear interpolation handles 8 points per iteration with AVX2 gathers when the 4 taps of the 8 points are inside the image.
+<image> is the CV_16UC1 buffer to read values from.
+<points> is the vector of points to read values from.
+<interpolation> is SAMPLE_NEAREST, SAMPLE_BILINEAR or SAMPLE_BICUBIC.
+<values> receives the value of each point in the same order as <points>, -1 for points outside the image.
+<lut> is an optional table of LUT_SIZE entries applied to every sampled value (e.g. brightness and contrast), NULL for none.
+*************************/
+void BufferGatherValues(const cv::Mat& image, const std::vector<cv::Point2f>& points, int interpolation, std::vector<int>& values, const unsigned short* lut = NULL) {
+    values.resize(points.size());
+    size_t i = 0;
+#if defined(__AVX2__)
+    if (interpolation == SAMPLE_BILINEAR && image.rows > 1 && image.cols > 1) {
+        const int stride = (int)(image.step / sizeof(unsigned short));
+        const int* base = (const int*)image.ptr<unsigned short>(0);
+        const __m256i max_x = _mm256_set1_epi32(image.cols - 2), max_y = _mm256_set1_epi32(image.rows - 2);
+        const __m256i zero = _mm256_setzero_si256(), low16 = _mm256_set1_epi32(0xFFFF), vstride = _mm256_set1_epi32(stride);
+        for (; i + 8 <= points.size(); i += 8) {
+            //// Deinterleave 8 points into x and y vectors
+            __m256 p0 = _mm256_loadu_ps(&points[i].x), p1 = _mm256_loadu_ps(&points[i + 4].x);
+            __m256 x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+            __m256 y = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+            __m256 fx0 = _mm256_floor_ps(x), fy0 = _mm256_floor_ps(y);
+            __m256i x0 = _mm256_cvttps_epi32(fx0), y0 = _mm256_cvttps_epi32(fy0);
+
+            //// Fall back to scalar code if any cell is not fully inside the image (or the coordinate is NaN)
+            __m256i outside = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi32(zero, x0), _mm256_cmpgt_epi32(x0, max_x)),
+                                              _mm256_or_si256(_mm256_cmpgt_epi32(zero, y0), _mm256_cmpgt_epi32(y0, max_y)));
+            if (!_mm256_testz_si256(outside, outside)) {
+                for (size_t k = i; k < i + 8; k++) {
+                    values[k] = BufferSampleValue(image, points[k].x, points[k].y, interpolation);
+                    if (lut && values[k] >= 0) values[k] = lut[values[k]];
+                }
+                continue;
+            }
+
+            //// One 32-bit gather reads two horizontal neighbours
+            __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y0, vstride), x0);
+            __m256i top = _mm256_i32gather_epi32(base, index, 2);
+            __m256i bottom = _mm256_i32gather_epi32(base, _mm256_add_epi32(index, vstride), 2);
+            __m256 p00 = _mm256_cvtepi32_ps(_mm256_and_si256(top, low16)), p01 = _mm256_cvtepi32_ps(_mm256_srli_epi32(top, 16));
+            __m256 p10 = _mm256_cvtepi32_ps(_mm256_and_si256(bottom, low16)), p11 = _mm256_cvtepi32_ps(_mm256_srli_epi32(bottom, 16));
+            __m256 fx = _mm256_sub_ps(x, fx0), fy = _mm256_sub_ps(y, fy0);
+            __m256 t = _mm256_add_ps(p00, _mm256_mul_ps(fx, _mm256_sub_ps(p01, p00)));
+            __m256 b = _mm256_add_ps(p10, _mm256_mul_ps(fx, _mm256_sub_ps(p11, p10)));
+            __m256 v = _mm256_add_ps(t, _mm256_mul_ps(fy, _mm256_sub_ps(b, t)));
+            _mm256_storeu_si256((__m256i*)&values[i], _mm256_cvtps_epi32(v));
+            if (lut) {
+                for (size_t k = i; k < i + 8; k++) values[k] = lut[values[k]];
+            }
+        }
+    }
+#endif
+    for (; i < points.size(); i++) {
+        values[i] = BufferSampleValue(image, points[i].x, points[i].y, interpolation);
+        if (lut && values[i] >= 0) values[i] = lut[values[i]];
+    }
+}
+
+/************************
+Read values of pixels from image and return the reference of the std::vector of class Coords where the coordinates will be stored with the pixel gray value and returned. 
+<filename> corresponding to the image to read values from.
+<points> is the vector of points to read values from.
+Returns vector of coordinates Coords containing x, y and value for each point. Points outside the image get value -1.
+*************************/
+std::vector<Coords> PointsGetValues(std::string filename, std::vector<cv::Point2i> points) {
+    MagickWand* mw = NULL;
+    MagickWandGenesis();
+    std::vector<Coords> coordinates(points.size());
+
+    /* Create a wand */
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+    /* Read the input image */
+    std::cout << "Opening file: " << filename << " to get bad pixel values... ";
+    if (!MagickReadImage(mw, filename.c_str())) {
+        std::cerr << std::endl << "Could not open " << filename << " image... Aborting." << std::endl;
+        exit(0);
+    }
+
+    //// Export the pixels once and read all the points from the buffer
+    size_t width = MagickGetImageWidth(mw);
+    size_t height = MagickGetImageHeight(mw);
+    cv::Mat image((int)height, (int)width, CV_16UC1);
+    MagickExportImagePixels(mw, 0, 0, width, height, "I", ShortPixel, image.data);
+    std::vector<cv::Point2f> fpoints(points.begin(), points.end());
+    std::vector<int> values;
+    BufferGatherValues(image, fpoints, SAMPLE_NEAREST, values);
+    for (size_t i = 0; i < points.size(); i++) {
+        coordinates[i].x = points[i].x;
+        coordinates[i].y = points[i].y;
+        coordinates[i].v = values[i];
+    }
+    std::cout << "OK!" << std::endl;
+    /* Tidy up */
+    if (mw) mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+    return coordinates;
+}
+
+/************************
+Remove points that have either negative x or y coordinate
+<points> is the input vector of points (it may contain negative points).
+Returns: vector of integer points without negative points.
+*************************/
+std::vector<cv::Point2i> RemoveNegativePoints(std::vector<cv::Point2i> points) {
+
+    std::vector<cv::Point2i> cleanvector;
+    for (int i = 0; i < points.size(); i++) {
+        if (points[i].x < 0 || points[i].y < 0) {
+            continue;
+        }
+        else {
+            cleanvector.push_back(points[i]);
+        }
+    }
+
+
+    return cleanvector;
+}
+
+//Compare coordinates by row, used to find the coordinates of a row band
+inline bool CoordsRowLess(const Coords& coords, int y) { return coords.y < y; }
+
+/************************
+Set values of pixels in a decoded image, writing straight into the buffer. With more than one thread each thread writes the coordinates of one row band of the image.
+<image> is the CV_16UC1 buffer to modify.
+<coordinates> has x, y and gray value to set. Coordinates with negative value are skipped. They must be sorted by row (e.g. raster order) to use several threads, otherwise one thread is used.
+<threads> is the number of row bands written in parallel, 0 for all the cores.
+*************************/
+void BufferSetValues(cv::Mat& image, const std::vector<Coords>& coordinates, int threads = 1) {
+    bool sorted = true;
+    for (size_t i = 1; i < coordinates.size() && sorted; i++) sorted = coordinates[i - 1].y <= coordinates[i].y;
+    if (!sorted || coordinates.size() < 4096) threads = 1; //not worth starting threads for a few pixels
+
+    ParallelBands(image.rows, threads, [&](int band, int first_row, int end_row) {
+        std::vector<Coords>::const_iterator it = coordinates.begin(), end = coordinates.end();
+        if (threads != 1) {
+            it = std::lower_bound(coordinates.begin(), coordinates.end(), first_row, CoordsRowLess);
+            end = std::lower_bound(it, coordinates.end(), end_row, CoordsRowLess);
+        }
+        for (; it != end; ++it) {
+            if (it->v < 0 || it->x < 0 || it->y < 0 || it->x >= image.cols || it->y >= image.rows) continue;
+            image.ptr<unsigned short>(it->y)[it->x] = (unsigned short)it->v;
+        }
+    });
+}
+
+/************************
+Set values of pixels in image.
+<infilename> corresponding to input image.
+<outfilename> corresponds to output image.
+<coordinates> has x, y and gray value to set and save in the output image.
+Returns true if execution was correct.
+*************************/
+/* Set values of pixels of image .*/
+bool SetValues(std::string infilename, std::string outfilename, std::vector<Coords>& coordinates) {
+    std::cout << "Setting pixel gray values in file: " << infilename << "... ";
+    MagickWand* mw = NULL;
+    MagickWandGenesis();
+    /* Create a wand */
+    mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+    /* Read the input image */
+    if (!MagickReadImage(mw, infilename.c_str())) {
+        std::cerr << std::endl << "Could not open " << infilename << " image... Aborting." << std::endl;
+        exit(0);
+    }
+
+    //// Export the pixels to a 16-bit buffer, set the values there and import them back
+    size_t width = MagickGetImageWidth(mw);
+    size_t height = MagickGetImageHeight(mw);
+    cv::Mat image((int)height, (int)width, CV_16UC1);
+    MagickExportImagePixels(mw, 0, 0, width, height, "I", ShortPixel, image.data);
+    BufferSetValues(image, coordinates);
+    MagickImportImagePixels(mw, 0, 0, width, height, "I", ShortPixel, image.data);
+
+    /* write it */
+    if (MagickWriteImage(mw, outfilename.c_str())) {
+        std::cout << "wrote final file in " << outfilename << "... DONE." << std::endl;
+    }
+    else {
+        std::cerr << "Couldn't write output file " << outfilename << "... ABORTING." << std::endl;
+        exit(0);
+    }
+
+    /* Tidy up */
+    if (mw) mw = DestroyMagickWand(mw);
+    MagickWandTerminus();
+    return true;
+}
+
+/************************
+***** IN-MEMORY PIPELINE *****
+The functions below work on decoded 16-bit buffers (cv::Mat of type CV_16UC1) instead of files, so each input is decoded once and only the corrected master is encoded.
+MagickWandGenesis() must be called once before using them and MagickWandTerminus() once at the end.
+*************************/
+
+/************************
+Build the lookup table of the ImageMagick brightness-contrast operator (MagickBrightnessContrastImage) for 16-bit values, so it is computed once and applied with one lookup per value.
+<brightness> is a value in percent -100 to 100.
+<contrast> is a value in percent -100 to 100.
+<lut> receives LUT_SIZE + 1 entries, the last one only pads the table for 32-bit gathers.
+*************************/
+void BuildBrightnessContrastLut(double brightness, double contrast, std::vector<unsigned short>& lut) {
+    //// Same slope and intercept as ImageMagick, applied as a polynomial function on values scaled to 0-1
+    double slope = tan(CV_PI * (contrast / 100.0 + 1.0) / 4.0);
+    if (slope < 0.0) slope = 0.0;
+    double intercept = brightness / 100.0 + ((100 - brightness) / 200.0) * (1.0 - slope);
+    lut.assign(LUT_SIZE + 1, 0);
+    for (int v = 0; v < LUT_SIZE; v++) {
+        double result = (slope * (1.0 / 65535.0) * v + intercept) * 65535.0;
+        //// Clamp and round as ImageMagick Q16 does
+        lut[v] = result <= 0.0 ? 0 : result >= 65535.0 ? 65535 : (unsigned short)(result + 0.5f);
+    }
+}
+
+/************************
+Apply a 16-bit lookup table to every pixel of a decoded image in place, 16 pixels per iteration with AVX2 gathers.
+<image> is the CV_16UC1 buffer.
+<lut> is a table of LUT_SIZE + 1 entries (see BuildBrightnessContrastLut()).
+<threads> is the number of row bands processed in parallel, 0 for all the cores.
+*************************/
+void BufferApplyLut(cv::Mat& image, const std::vector<unsigned short>& lut, int threads = 1) {
+    ParallelBands(image.rows, threads, [&](int band, int first_row, int end_row) {
+        for (int y = first_row; y < end_row; y++) {
+            unsigned short* row = image.ptr<unsigned short>(y);
+            int x = 0;
+#if defined(__AVX2__)
+            const int* table = (const int*)&lut[0];
+            const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+            for (; x + 16 <= image.cols; x += 16) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(row + x));
+                __m256i lo = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), 2), low16);
+                __m256i hi = _mm256_and_si256(_mm256_i32gather_epi32(table, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), 2), low16);
+                _mm256_storeu_si256((__m256i*)(row + x), _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+            }
+#endif
+            for (; x < image.cols; x++) row[x] = lut[row[x]];
+        }
+    });
+}
+
+/************************
+Apply a 16-bit lookup table to a list of values in place.
+<coordinates> has the values to map. Coordinates with negative value are skipped.
+<lut> is a table of LUT_SIZE + 1 entries (see BuildBrightnessContrastLut()).
+*************************/
+void ValuesApplyLut(std::vector<Coords>& coordinates, const std::vector<unsigned short>& lut) {
+    for (size_t i = 0; i < coordinates.size(); i++) {
+        if (coordinates[i].v >= 0) coordinates[i].v = lut[std::min(coordinates[i].v, 65535)];
+    }
+}
+
+//Class to store a master/slave pair and the intermediate results of the in-memory pipeline
+class FramePair {
+public:
+    std::string master_file, slave_file, output_file; //input and output file names
+    cv::Mat master, slave; //decoded 16-bit grayscale buffers
+    cv::Mat slaveflat; //slave warped to the flat image and adjusted, for dense sampling (SparseSlaveSampling=0)
+    bool slave_prepared; //PipelinePrepareSlave() was run for the decoded slave
+    std::shared_ptr<MappedFile> master_map, slave_map; //mapped files when the buffers are read-only views of uncompressed TIFF files (see ImageMap())
+    bool master_fits; //master was read with FitsLoad(), a FITS output is written with FitsPatchCopy()
+    size_t sequence; //position of the pair in the series
+
+    FramePair() : slave_prepared(false), master_fits(false), sequence(0) {}
+    std::vector<cv::Point2f> hotpoints; //coordinates of hot pixels in the master raw image
+    std::vector<PixelRun> hotruns; //run-length encoded mask of the streaks in the master raw image, used instead of hotpoints with HotPixelDetection=1
+    std::vector<int> runvalues; //replacement value of every pixel of hotruns, run after run, taken from the slave image
+    std::vector<Coords> corrections; //master raw coordinates and replacement value taken from the slave image, of the hotpoints and the known defects
+};
+
+//Class to store the 3x3 matrices (CV_64F) that take raw image coordinates to flat image coordinates
+class RigTransforms {
+public:
+    cv::Mat master; //master raw -> flat
+    cv::Mat slave; //slave raw -> flat
+    cv::Mat master_to_slave; //master raw -> slave raw, i.e. inverse of slave composed with master
+};
+
+//Class to store the fixed-point remap maps of a dense warp, in the format of cv::convertMaps() with CV_16SC2
+class RemapTables {
+public:
+    cv::Size size; //size of the flat image the maps were built for
+    cv::Mat map1; //CV_16SC2 integer source coordinates
+    cv::Mat map2; //CV_16UC1 interpolation table index (fractional part of the source coordinates)
+};
+
+//Value of CorrespondenceTable::index for master pixels without a slave sample
+const unsigned int CORRESPONDENCE_INVALID = 0xFFFFFFFFu;
+
+//Class to store the master raw -> slave raw correspondence of every master pixel, mapped from the cache file
+class CorrespondenceTable {
+public:
+    int width, height; //size of the master image
+    int slave_width, slave_height; //size of the slave image
+    const unsigned int* index; //per master pixel: linear index of the top-left slave pixel of the bilinear cell, or CORRESPONDENCE_INVALID
+    const unsigned short* weights; //per master pixel: horizontal fraction in the low byte and vertical fraction in the high byte, in 1/256
+    std::shared_ptr<MappedFile> file; //cache file holding the table
+
+    CorrespondenceTable() : width(0), height(0), slave_width(0), slave_height(0), index(NULL), weights(NULL) {}
+};
+
+//Class to store the known defective pixels of the master sensor, loaded once from DefectMapFile
+class DefectMap {
+public:
+    cv::Size size; //size of the sensor, 0 x 0 for a text list until the first frame
+    std::vector<cv::Point2f> points; //master raw coordinates of the defects, in raster order once prepared
+    std::vector<unsigned int> indices; //sorted raster indices of the defects, built for the frame size by DefectMapPrepare()
+    std::vector<unsigned long long> bits; //one bit per pixel, set for defects
+    std::vector<cv::Point2f> slave_points, flat_points; //defects in slave raw and flat coordinates, computed once for the rig
+
+    //Check if the pixel with raster index <index> is a known defect
+    bool Contains(unsigned int index) const { return (bits[index >> 6] >> (index & 63)) & 1; }
+};
+
+/************************
+***** DIAGNOSTICS *****
+Quicklook images of the corrected masters with circles around the corrected pixels (Diagnostics in the config file), rendered by a background thread from the buffers already decoded by the pipeline.
+Frames are dropped when the renderer falls behind, so the correction never waits for it.
+*************************/
+
+//Class of a frame waiting to be rendered
+class DiagnosticsJob {
+public:
+    std::string output_file; //quicklook image
+    cv::Mat master; //master buffer handed over by the pipeline
+    std::shared_ptr<MappedFile> master_map; //keeps the file of a mapped master open
+    std::vector<cv::Point2i> points; //corrected pixels to annotate, in master raw coordinates
+    std::vector<Coords> corrections; //replacement values, the master buffer is still the raw image for mapped TIFF and FITS masters and with OutputMode=1
+};
+
+/************************
+Render a quicklook: the corrected master downsampled, stretched to 8 bits between its minimum and maximum, with a circle around every annotated pixel.
+The corrections are applied to the downsampled copy, so the master buffer is never written and a buffer already corrected is not changed.
+<job> has the master buffer, the corrections, the points and the output file.
+<scale> is the downsampling factor, 1 for full resolution.
+Returns true if execution was correct.
+*************************/
+bool DiagnosticsRender(const DiagnosticsJob& job, int scale) {
+    cv::Mat small;
+    if (scale > 1) cv::resize(job.master, small, cv::Size(std::max(job.master.cols / scale, 1), std::max(job.master.rows / scale, 1)), 0, 0, cv::INTER_AREA);
+    else if (!job.corrections.empty()) small = job.master.clone();
+    else small = job.master;
+
+    //// Each replaced pixel moves its quicklook pixel by its share of the area
+    double share = 1.0 / ((double)scale * scale);
+    for (size_t i = 0; i < job.corrections.size(); i++) {
+        const Coords& c = job.corrections[i];
+        if (c.v < 0 || c.x < 0 || c.y < 0 || c.x >= job.master.cols || c.y >= job.master.rows || c.x / scale >= small.cols || c.y / scale >= small.rows) continue;
+        int delta = std::min(c.v, 65535) - (int)job.master.ptr<unsigned short>(c.y)[c.x];
+        if (delta == 0) continue;
+        unsigned short& pixel = small.ptr<unsigned short>(c.y / scale)[c.x / scale];
+        pixel = (unsigned short)std::min(std::max((int)floor(pixel + delta * share + 0.5), 0), 65535);
+    }
+    unsigned short low = 65535, high = 0;
+    for (int y = 0; y < small.rows; y++) {
+        const unsigned short* row = small.ptr<unsigned short>(y);
+        for (int x = 0; x < small.cols; x++) {
+            low = std::min(low, row[x]);
+            high = std::max(high, row[x]);
+        }
+    }
+    double gain = 255.0 / std::max((int)high - (int)low, 1);
+    cv::Mat quicklook;
+    small.convertTo(quicklook, CV_8U, gain, -low * gain);
+    int radius = std::max(15 / std::max(scale, 1), 3);
+    for (size_t i = 0; i < job.points.size(); i++) {
+        cv::circle(quicklook, cv::Point2i(job.points[i].x / scale, job.points[i].y / scale), radius, 255, 1);
+    }
+    return cv::imwrite(job.output_file, quicklook);
+}
+
+//Class of the diagnostics renderer: a background thread rendering the frames of a bounded queue
+class Diagnostics {
+public:
+    int scale; //DiagnosticsScale: downsampling factor of the quicklooks
+    size_t max_annotations; //DiagnosticsMaxAnnotations: maximum number of circles of a quicklook
+    std::atomic<size_t> rendered, dropped; //frames rendered and dropped because the queue was full
+
+    Diagnostics(int depth, int scale, int max_annotations) : scale(std::max(scale, 1)), max_annotations((size_t)std::max(max_annotations, 0)), rendered(0), dropped(0), queue(depth) {
+        renderer = std::thread([this]() {
+            std::shared_ptr<DiagnosticsJob> job;
+            while (queue.Pop(job)) {
+                if (DiagnosticsRender(*job, this->scale)) rendered++;
+                else LogLine(LOG_WARNING) << "Couldn't write quicklook " << job->output_file << ".";
+                job.reset();
+            }
+        });
+    }
+
+    //Render the frames already queued and stop
+    ~Diagnostics() {
+        queue.Close();
+        renderer.join();
+        LogLine(LOG_INFO) << rendered << " quicklooks written, " << dropped << " frames dropped by the diagnostics.";
+    }
+
+    /************************
+    Queue a corrected frame to be rendered, or drop it if the renderer is behind. Never waits.
+    <pair> has the master buffer and the corrections. The master buffer and, if the frame is queued, the corrections are handed over to the renderer and emptied in the pair.
+    Returns true if the frame was queued.
+    *************************/
+    bool Submit(FramePair& pair) {
+        if (pair.master.empty()) return false;
+        if (!pair.hotruns.empty()) {
+            RunsAddCorrections(pair.hotruns, pair.runvalues, pair.corrections);
+            pair.hotruns.clear();
+            pair.runvalues.clear();
+        }
+        std::shared_ptr<DiagnosticsJob> job(new DiagnosticsJob());
+        size_t dot = pair.output_file.find_last_of('.');
+        job->output_file = pair.output_file.substr(0, dot) + "_quicklook.png";
+        //// Evenly spread annotations when there are more than the maximum
+        size_t count = std::min(pair.corrections.size(), max_annotations);
+        job->points.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            const Coords& c = pair.corrections[i * pair.corrections.size() / count];
+            job->points[i] = cv::Point2i(c.x, c.y);
+        }
+        job->master = pair.master;
+        job->master_map = pair.master_map;
+        job->corrections.swap(pair.corrections);
+        pair.master = cv::Mat();
+        if (queue.TryPush(job)) return true;
+        pair.corrections.swap(job->corrections);
+        dropped++;
+        LogLine(LOG_DEBUG) << "Diagnostics behind, quicklook of " << pair.master_file << " dropped.";
+        return false;
+    }
+
+private:
+    BoundedQueue<std::shared_ptr<DiagnosticsJob> > queue;
+    std::thread renderer;
+};
+
+//Class to store the parameters of the pipeline that are read once from the config file
+class PipelineContext {
+public:
+    std::vector<ConfigParameters> config_parameters; //config file as read by GetConfigFile()
+    long threshold; //MasterThresholdHotPixels
+    int detection; //HotPixelDetection: DETECT_PIXELS, DETECT_STREAKS or DETECT_TEMPORAL
+    long threshold_low; //MasterThresholdLow: threshold of the pixels of a streak and floor of the adaptive threshold, MasterThresholdHotPixels if not set
+    int threshold_mode; //ThresholdMode: THRESHOLD_FIXED, THRESHOLD_PERCENTILE or THRESHOLD_PLATEAU
+    double threshold_percentile; //ThresholdPercentile: percent of the pixels of a frame below the threshold of THRESHOLD_PERCENTILE
+    size_t max_hot; //MaxHotPixels: most hot pixels corrected in a frame, the brightest are kept, 0 for no limit
+    int dilation; //HotPixelDilation: pixels the streaks are grown on each side
+    int temporal_window; //TemporalWindow: number of frames of the history of each pixel
+    double temporal_z; //TemporalZThreshold: standard deviations above its mean for a pixel to be an outlier
+    TemporalStats temporal; //history of each pixel, updated by PipelineDetect() with every frame
+    DefectMap defects; //DefectMapFile: known defects of the master sensor, corrected without being detected
+    double brightness, contrast; //SlaveBrightness and SlaveContrast
+    std::vector<unsigned short> brightness_contrast_lut; //transfer function of SlaveBrightness and SlaveContrast, see BuildBrightnessContrastLut()
+    int threads; //Threads: number of threads used by parallel kernels, 0 for all the cores
+    int interpolation; //SlaveInterpolation: SAMPLE_NEAREST, SAMPLE_BILINEAR or SAMPLE_BICUBIC
+    bool sparse; //SparseSlaveSampling: sample the raw slave image only at the hot pixels instead of warping it
+    RigTransforms rig; //matrices of the rig built from the registration points
+    RemapTables slave_maps; //remap maps of the slave dense warp, built on first use for the slave image size
+    bool use_correspondence; //CorrespondenceCache: take slave values from the cached correspondence table
+    unsigned long long rig_hash; //hash of the registration points, key of the correspondence cache
+    CorrespondenceTable correspondence; //mapped on first use for the master and slave image sizes
+    int stream_rows; //StreamingBandRows: master rows per band of the streaming mode, 0 to decode whole frames
+    int output_mode; //OutputMode: OUTPUT_FRAME, OUTPUT_SIDECAR or OUTPUT_BOTH
+    int tiff_codec; //OutputCompression: TIFF_WRITE_ENCODER, TIFF_WRITE_DEFLATE or TIFF_WRITE_ZSTD
+    int tiff_level; //OutputCompressionLevel: level of the codec, 0 for its default
+    int tiff_rows_per_strip; //OutputRowsPerStrip: rows of the strips compressed in parallel
+    int sidecar_level; //SidecarDeflateLevel: zlib level of the sidecar payload, 0 to store it as is
+    std::string instrumentation_file; //InstrumentationFile: base name of the stage timing files, empty to disable them
+    std::shared_ptr<Diagnostics> diagnostics; //Diagnostics: renderer of the quicklooks, NULL if they are disabled
+};
+
+
+/************************
+Build the matrices of the rig from the registration points of master and slave.
+<config_parameters> is generated with GetConfigFile().
+Returns the RigTransforms with master, slave and master to slave matrices.
+*************************/
+RigTransforms GetRigTransforms(const std::vector<ConfigParameters>& config_parameters) {
+    RigTransforms rig;
+    rig.master = GetRotationAndPerspectiveMatrix("Master", config_parameters);
+    rig.slave = GetRotationAndPerspectiveMatrix("Slave", config_parameters);
+    rig.master_to_slave = rig.slave.inv() * rig.master;
+    return rig;
+}
+
+
+/************************
+Build the fixed-point remap maps for a dense warp, so the warp of every frame is a single remap pass.
+<matrix> is the 3x3 matrix taking raw coordinates to flat coordinates (see GetRotationAndPerspectiveMatrix()).
+<size> is the size of the raw and flat images.
+<tables> receives the maps.
+<threads> is the number of row bands built in parallel, 0 for all the cores.
+*************************/
+void BuildRemapTables(const cv::Mat& matrix, cv::Size size, RemapTables& tables, int threads = 1) {
+    const int INTER_BITS = 5, INTER_TAB_SIZE = 1 << INTER_BITS; //same fixed-point precision as cv::remap
+    cv::Mat inverse = matrix.inv();
+    const double* h = inverse.ptr<double>(0);
+    tables.size = size;
+    tables.map1.create(size, CV_16SC2);
+    tables.map2.create(size, CV_16UC1);
+    ParallelBands(size.height, threads, [&](int, int first_row, int end_row) {
+        for (int y = first_row; y < end_row; y++) {
+            short* m1 = tables.map1.ptr<short>(y);
+            unsigned short* m2 = tables.map2.ptr<unsigned short>(y);
+            for (int x = 0; x < size.width; x++) {
+                //// Flat pixel back to raw coordinates
+                double w = h[6] * x + h[7] * y + h[8];
+                double sx = SHRT_MIN * INTER_TAB_SIZE, sy = SHRT_MIN * INTER_TAB_SIZE; //outside of the image if the point is at infinity
+                if (w != 0) {
+                    w = INTER_TAB_SIZE / w;
+                    sx = std::max(std::min((h[0] * x + h[1] * y + h[2]) * w, (double)SHRT_MAX * INTER_TAB_SIZE), (double)SHRT_MIN * INTER_TAB_SIZE);
+                    sy = std::max(std::min((h[3] * x + h[4] * y + h[5]) * w, (double)SHRT_MAX * INTER_TAB_SIZE), (double)SHRT_MIN * INTER_TAB_SIZE);
+                }
+                int ix = cvRound(sx), iy = cvRound(sy);
+                m1[2 * x] = (short)(ix >> INTER_BITS);
+                m1[2 * x + 1] = (short)(iy >> INTER_BITS);
+                m2[x] = (unsigned short)((iy & (INTER_TAB_SIZE - 1)) * INTER_TAB_SIZE + (ix & (INTER_TAB_SIZE - 1)));
+            }
+        }
+    });
+}
+
+/************************
+Dense warp with the remap maps of the rig, split in row bands of the output processed in parallel.
+<input> is the CV_16UC1 raw image.
+<output> receives the flat image, of the size of the maps.
+<tables> are the maps built with BuildRemapTables().
+<threads> is the number of row bands warped in parallel, 0 for all the cores.
+*************************/
+void BufferRemap(const cv::Mat& input, cv::Mat& output, const RemapTables& tables, int threads = 1) {
+    output.create(tables.map1.rows, tables.map1.cols, input.type());
+    ParallelBands(output.rows, threads, [&](int, int first_row, int end_row) {
+        cv::Mat band = output.rowRange(first_row, end_row); //view of the output rows, remap writes into it
+        cv::remap(input, band, tables.map1.rowRange(first_row, end_row), tables.map2.rowRange(first_row, end_row), cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+    });
+}
+
+/************************
+Hash the registration points and rotations of the config (Master/Slave Source, Dest and Rotation parameters), so any change in the rig geometry gives a different value.
+<config_parameters> is generated with GetConfigFile().
+Returns the 64 bit FNV-1a hash of the names and values, independent of their order in the file.
+*************************/
+unsigned long long GetRigConfigHash(const std::vector<ConfigParameters>& config_parameters) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < config_parameters.size(); i++) {
+        const std::string& name = config_parameters[i].parameter;
+        bool camera = name.compare(0, 6, "Master") == 0 || name.compare(0, 5, "Slave") == 0;
+        bool geometry = name.find("Source") != std::string::npos || name.find("Dest") != std::string::npos || name.find("Rotation") != std::string::npos;
+        if (camera && geometry) names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < names.size(); i++) {
+        double value = GetParameterValueFromConfig(config_parameters, names[i]);
+        std::string key = names[i] + "=";
+        key.append((const char*)&value, sizeof(value));
+        for (size_t j = 0; j < key.size(); j++) {
+            hash ^= (unsigned char)key[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+//Header of the correspondence cache file, followed by the index plane (unsigned int per master pixel) and the weights plane (unsigned short per master pixel)
+struct CorrespondenceHeader {
+    char magic[8]; //"MCCORR1"
+    unsigned int byte_order; //0x01020304 written in the native byte order
+    unsigned int width, height, slave_width, slave_height;
+    unsigned int reserved;
+    unsigned long long hash; //GetRigConfigHash()
+    unsigned char padding[24]; //header is 64 bytes so the planes are aligned
+};
+
+/************************
+Build the correspondence cache file: for every master raw pixel, the slave raw bilinear cell and its weights in 1/256.
+<filename> is the cache file to write. It is written to a temporary file and renamed, so concurrent readers never see a partial file.
+<rig> is generated with GetRigTransforms().
+<hash> is GetRigConfigHash() of the config the rig was built from.
+<master_size> and <slave_size> are the image sizes.
+Returns true if execution was correct.
+*************************/
+bool BuildCorrespondenceFile(std::string filename, const RigTransforms& rig, unsigned long long hash, cv::Size master_size, cv::Size slave_size) {
+    LogLine(LOG_INFO) << "Building correspondence cache " << filename << "...";
+    CorrespondenceHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "MCCORR1");
+    header.byte_order = 0x01020304;
+    header.width = master_size.width;
+    header.height = master_size.height;
+    header.slave_width = slave_size.width;
+    header.slave_height = slave_size.height;
+    header.hash = hash;
+
+    std::string tmpname = filename + ".tmp";
+    std::ofstream out(tmpname.c_str(), std::ios::binary);
+    if (!out.is_open()) {
+        LogLine(LOG_ERROR) << "Couldn't write correspondence cache " << tmpname << ".";
+        return false;
+    }
+    out.write((const char*)&header, sizeof(header));
+
+    //// Index plane, one row at a time
+    const double* h = rig.master_to_slave.ptr<double>(0);
+    std::vector<unsigned int> index(master_size.width);
+    std::vector<unsigned short> weights((size_t)master_size.width * master_size.height);
+    for (int y = 0; y < master_size.height; y++) {
+        unsigned short* w_row = &weights[(size_t)y * master_size.width];
+        for (int x = 0; x < master_size.width; x++) {
+            double w = h[6] * x + h[7] * y + h[8];
+            index[x] = CORRESPONDENCE_INVALID;
+            w_row[x] = 0;
+            if (w == 0) continue;
+            double sx = (h[0] * x + h[1] * y + h[2]) / w;
+            double sy = (h[3] * x + h[4] * y + h[5]) / w;
+            if (!(sx >= 0 && sy >= 0 && sx < slave_size.width - 1 && sy < slave_size.height - 1)) continue;
+            int x0 = (int)sx, y0 = (int)sy;
+            int fx = cvRound((sx - x0) * 256), fy = cvRound((sy - y0) * 256);
+            if (fx == 256) { fx = 0; x0++; }
+            if (fy == 256) { fy = 0; y0++; }
+            if (x0 >= slave_size.width - 1 || y0 >= slave_size.height - 1) continue;
+            index[x] = (unsigned int)y0 * slave_size.width + x0;
+            w_row[x] = (unsigned short)(fx | (fy << 8));
+        }
+        out.write((const char*)&index[0], index.size() * sizeof(unsigned int));
+    }
+    out.write((const char*)&weights[0], weights.size() * sizeof(unsigned short));
+    out.close();
+    if (out.fail()) {
+        LogLine(LOG_ERROR) << "Couldn't write correspondence cache " << tmpname << ".";
+        remove(tmpname.c_str());
+        return false;
+    }
+#ifdef _WIN32 
+    remove(filename.c_str());
+#endif
+    if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+        LogLine(LOG_ERROR) << "Couldn't rename correspondence cache to " << filename << ".";
+        remove(tmpname.c_str());
+        return false;
+    }
+    LogLine(LOG_INFO) << "Correspondence cache " << filename << " OK!";
+    return true;
+}
+
+/************************
+Map the correspondence cache file of the rig, building it first if it doesn't exist or doesn't match the rig and image sizes.
+<rig> is generated with GetRigTransforms().
+<hash> is GetRigConfigHash() of the config the rig was built from.
+<master_size> and <slave_size> are the image sizes.
+<table> receives the mapped table.
+Returns true if execution was correct.
+*************************/
+bool LoadCorrespondenceTable(const RigTransforms& rig, unsigned long long hash, cv::Size master_size, cv::Size slave_size, CorrespondenceTable& table) {
+    char name[128];
+    snprintf(name, sizeof(name), "MultiCamCorrespondence_%016llx_%dx%d_%dx%d.bin", hash, master_size.width, master_size.height, slave_size.width, slave_size.height);
+    size_t pixels = (size_t)master_size.width * master_size.height;
+    size_t expected = sizeof(CorrespondenceHeader) + pixels * (sizeof(unsigned int) + sizeof(unsigned short));
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+        if (file->Open(name, false) && file->size == expected) {
+            const CorrespondenceHeader* header = (const CorrespondenceHeader*)file->data;
+            if (strcmp(header->magic, "MCCORR1") == 0 && header->byte_order == 0x01020304 && header->hash == hash &&
+                (int)header->width == master_size.width && (int)header->height == master_size.height &&
+                (int)header->slave_width == slave_size.width && (int)header->slave_height == slave_size.height) {
+                table.width = master_size.width;
+                table.height = master_size.height;
+                table.slave_width = slave_size.width;
+                table.slave_height = slave_size.height;
+                table.index = (const unsigned int*)(file->data + sizeof(CorrespondenceHeader));
+                table.weights = (const unsigned short*)(file->data + sizeof(CorrespondenceHeader) + pixels * sizeof(unsigned int));
+                table.file = file;
+                LogLine(LOG_INFO) << "Mapped correspondence cache " << name;
+                return true;
+            }
+        }
+        file->Close();
+        if (attempt == 0 && !BuildCorrespondenceFile(name, rig, hash, master_size, slave_size)) return false;
+    }
+    LogLine(LOG_ERROR) << "Couldn't map correspondence cache " << name << ".";
+    return false;
+}
+
+/************************
+Read the slave values of master points with one lookup in the correspondence table and a bilinear interpolation.
+<table> is mapped with LoadCorrespondenceTable().
+<slave> is the CV_16UC1 slave raw buffer the table was built for.
+<hotpoints> are points of the master raw image.
+Returns vector of coordinates Coords with the master x, y and the slave value, in the same order as <hotpoints>. Points without slave sample get value -1.
+*************************/
+std::vector<Coords> CorrespondenceGetValues(const CorrespondenceTable& table, const cv::Mat& slave, const std::vector<cv::Point2f>& hotpoints) {
+    std::vector<Coords> coordinates(hotpoints.size());
+    const unsigned short* pixels = slave.ptr<unsigned short>(0);
+    size_t stride = slave.step / sizeof(unsigned short);
+    for (size_t i = 0; i < hotpoints.size(); i++) {
+        int x = (int)hotpoints[i].x, y = (int)hotpoints[i].y;
+        coordinates[i].x = x;
+        coordinates[i].y = y;
+        coordinates[i].v = -1;
+        if (x < 0 || y < 0 || x >= table.width || y >= table.height) continue;
+        size_t m = (size_t)y * table.width + x;
+        unsigned int index = table.index[m];
+        if (index == CORRESPONDENCE_INVALID) continue;
+
+        //// Bilinear interpolation with weights in 1/256
+        const unsigned short* p = pixels + (index / table.slave_width) * stride + (index % table.slave_width);
+        unsigned int fx = table.weights[m] & 0xFF, fy = table.weights[m] >> 8;
+        unsigned int top = p[0] * (256 - fx) + p[1] * fx;
+        unsigned int bottom = p[stride] * (256 - fx) + p[stride + 1] * fx;
+        coordinates[i].v = (int)((top * (256 - fy) + bottom * fy + 32768) >> 16);
+    }
+    return coordinates;
+}
+
+//Header of a defect map file, followed by <count> sorted 32-bit raster indices
+struct DefectMapHeader {
+    char magic[8]; //"MCDEFCT1"
+    unsigned int width, height; //size of the sensor
+    unsigned long long count; //number of defects
+};
+
+/************************
+Load the known defects of the master sensor.
+<filename> is a defect map written by DefectMapSave() (.bin) or a text file with x y coordinates per row (see GetPointsFromFile()).
+<defects> receives the defects.
+Returns true if execution was correct.
+*************************/
+bool DefectMapLoad(std::string filename, DefectMap& defects) {
+    defects = DefectMap();
+    size_t dot = filename.find_last_of('.');
+    if (dot != std::string::npos && filename.substr(dot) == ".txt") {
+        defects.points = GetPointsFromFile(filename);
+        return !defects.points.empty();
+    }
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    DefectMapHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "MCDEFCT1", 8) != 0) {
+        LogLine(LOG_ERROR) << "Couldn't read defect map " << filename << ".";
+        return false;
+    }
+    std::vector<unsigned int> indices((size_t)header.count);
+    if (header.count && !file.read((char*)&indices[0], indices.size() * sizeof(unsigned int))) {
+        LogLine(LOG_ERROR) << "Defect map " << filename << " is truncated.";
+        return false;
+    }
+    defects.size = cv::Size((int)header.width, (int)header.height);
+    defects.points = IndicesToPoints(indices, defects.size.width);
+    LogLine(LOG_INFO) << "Read defect map: " << filename << "... " << defects.points.size() << " defects OK!";
+    return true;
+}
+
+/************************
+Save known defects of the master sensor as a defect map.
+<filename> is the defect map file.
+<size> is the size of the sensor.
+<indices> are the sorted raster indices of the defects.
+Returns true if execution was correct.
+*************************/
+bool DefectMapSave(std::string filename, cv::Size size, const std::vector<unsigned int>& indices) {
+    DefectMapHeader header;
+    memcpy(header.magic, "MCDEFCT1", 8);
+    header.width = (unsigned int)size.width;
+    header.height = (unsigned int)size.height;
+    header.count = indices.size();
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    if (!indices.empty()) file.write((const char*)&indices[0], indices.size() * sizeof(unsigned int));
+    if (!file) {
+        LogLine(LOG_ERROR) << "Couldn't write defect map " << filename << ".";
+        return false;
+    }
+    return true;
+}
+
+//Output of the corrected frames (OutputMode in the config file)
+const int OUTPUT_FRAME = 0; //corrected master image
+const int OUTPUT_SIDECAR = 1; //correction sidecar only, the raw master is corrected when it is read (see SidecarApply())
+const int OUTPUT_BOTH = 2; //corrected master image and its sidecar
+
+//Encoder of the corrected TIFF images (OutputCompression in the config file)
+const int TIFF_WRITE_ENCODER = 0; //ImageMagick encoder of ImageSave(), one thread and its default settings
+const int TIFF_WRITE_DEFLATE = 1; //Deflate with horizontal predictor, strips compressed in parallel
+const int TIFF_WRITE_ZSTD = 2; //Zstandard with horizontal predictor, strips compressed in parallel (build with -DMULTICAM_HAVE_ZSTD and -lzstd)
+
+#ifdef MULTICAM_HAVE_ZSTD
+const bool TIFF_HAVE_ZSTD = true;
+#else
+const bool TIFF_HAVE_ZSTD = false; //TIFF_WRITE_ZSTD writes Deflate
+#endif
+#ifndef COMPRESSION_ZSTD
+#define COMPRESSION_ZSTD 50000 //libtiff 4.0.10 and later
+#endif
+
+//Header of a correction sidecar file, followed by <payload_bytes> of payload: <count> varint deltas of the sorted raster indices (the first from 0) and <count> 16-bit values, as a zlib stream if <deflated> is set
+//Header fields and values are in the byte order of the machine that wrote the file, given by <byte_order>; files of the other byte order are rejected
+struct SidecarHeader {
+    char magic[8]; //"MCSIDE1"
+    unsigned int width, height; //size of the master frame
+    unsigned long long count; //number of corrected pixels
+    unsigned int deflated; //1 if the payload is deflated
+    unsigned int byte_order; //0x01020304 as written by the machine that saved the file
+    unsigned long long raw_bytes; //bytes of the payload before deflate
+    unsigned long long payload_bytes; //bytes of the payload in the file
+};
+
+/************************
+Name of the sidecar of a corrected image, the image name with the extension .mcs.
+<output_file> is the corrected image name.
+Returns the sidecar file name.
+*************************/
+std::string SidecarFileName(std::string output_file) {
+    size_t dot = output_file.find_last_of('.');
+    size_t slash = output_file.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return output_file + ".mcs";
+    return output_file.substr(0, dot) + ".mcs";
+}
+
+/************************
+Save the corrections of a frame as a sidecar, so only the corrected pixels are written instead of the whole frame.
+<filename> is the sidecar file.
+<size> is the size of the master frame.
+<coordinates> has the coordinates and value of the corrected pixels. Coordinates with negative value are skipped.
+<level> is the zlib level of the payload, 1 (fastest) to 9 (smallest), 0 to store it as is. The payload is stored as is if deflate does not make it smaller.
+Returns true if execution was correct.
+*************************/
+bool SidecarSave(std::string filename, cv::Size size, const std::vector<Coords>& coordinates, int level) {
+    //// Corrections in raster order
+    std::vector<std::pair<unsigned int, unsigned short> > pixels;
+    pixels.reserve(coordinates.size());
+    for (size_t i = 0; i < coordinates.size(); i++) {
+        const Coords& c = coordinates[i];
+        if (c.v < 0 || c.x < 0 || c.y < 0 || c.x >= size.width || c.y >= size.height) continue;
+        pixels.push_back(std::make_pair((unsigned int)c.y * size.width + c.x, (unsigned short)std::min(c.v, 65535)));
+    }
+    std::stable_sort(pixels.begin(), pixels.end(), [](const std::pair<unsigned int, unsigned short>& a, const std::pair<unsigned int, unsigned short>& b) { return a.first < b.first; });
+
+    //// Payload: index deltas as varints (7 bits per byte, low bits first), then the values
+    std::vector<unsigned char> raw;
+    raw.reserve(pixels.size() * 4);
+    unsigned int previous = 0;
+    for (size_t i = 0; i < pixels.size(); i++) {
+        unsigned int delta = pixels[i].first - previous;
+        previous = pixels[i].first;
+        while (delta >= 0x80) {
+            raw.push_back((unsigned char)(delta | 0x80));
+            delta >>= 7;
+        }
+        raw.push_back((unsigned char)delta);
+    }
+    size_t values_offset = raw.size();
+    raw.resize(values_offset + pixels.size() * sizeof(unsigned short));
+    for (size_t i = 0; i < pixels.size(); i++) memcpy(&raw[values_offset + i * sizeof(unsigned short)], &pixels[i].second, sizeof(unsigned short));
+
+    SidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "MCSIDE1", 8);
+    header.byte_order = 0x01020304;
+    header.width = (unsigned int)size.width;
+    header.height = (unsigned int)size.height;
+    header.count = pixels.size();
+    header.raw_bytes = raw.size();
+    std::vector<unsigned char> deflated;
+    if (level > 0 && !raw.empty()) {
+        uLongf bytes = compressBound((uLong)raw.size());
+        deflated.resize(bytes);
+        if (compress2(&deflated[0], &bytes, &raw[0], (uLong)raw.size(), std::min(level, 9)) == Z_OK && bytes < raw.size()) {
+            deflated.resize(bytes);
+            header.deflated = 1;
+        }
+    }
+    const std::vector<unsigned char>& payload = header.deflated ? deflated : raw;
+    header.payload_bytes = payload.size();
+
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    if (!payload.empty()) file.write((const char*)&payload[0], payload.size());
+    if (!file) {
+        LogLine(LOG_ERROR) << "Couldn't write sidecar " << filename << ".";
+        return false;
+    }
+    return true;
+}
+
+/************************
+Load the corrections of a frame from a sidecar written by SidecarSave().
+<filename> is the sidecar file.
+<size> receives the size of the master frame.
+<coordinates> receives the coordinates and value of the corrected pixels, in raster order.
+Returns true if execution was correct.
+*************************/
+bool SidecarLoad(std::string filename, cv::Size& size, std::vector<Coords>& coordinates) {
+    coordinates.clear();
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    SidecarHeader header;
+    bool read = file.read((char*)&header, sizeof(header)) && memcmp(header.magic, "MCSIDE1", 8) == 0;
+    if (read && header.byte_order != 0x01020304) {
+        LogLine(LOG_ERROR) << "Sidecar " << filename << " was written on a machine of another byte order.";
+        return false;
+    }
+    if (!read || header.width == 0 ||
+        (unsigned long long)header.width * header.height > 0xFFFFFFFFull || header.count > (unsigned long long)header.width * header.height ||
+        header.raw_bytes < header.count * (1 + sizeof(unsigned short)) || header.raw_bytes > header.count * (5 + sizeof(unsigned short)) || header.payload_bytes > header.raw_bytes) {
+        LogLine(LOG_ERROR) << "Couldn't read sidecar " << filename << ".";
+        return false;
+    }
+    std::vector<unsigned char> payload((size_t)header.payload_bytes), raw;
+    if (!payload.empty() && !file.read((char*)&payload[0], payload.size())) {
+        LogLine(LOG_ERROR) << "Sidecar " << filename << " is truncated.";
+        return false;
+    }
+    if (header.deflated) {
+        raw.resize((size_t)header.raw_bytes);
+        uLongf bytes = (uLongf)raw.size();
+        if (raw.empty() || payload.empty() || uncompress(&raw[0], &bytes, &payload[0], (uLong)payload.size()) != Z_OK || bytes != raw.size()) {
+            LogLine(LOG_ERROR) << "Sidecar " << filename << " is corrupted.";
+            return false;
+        }
+    }
+    else raw.swap(payload);
+    if (raw.size() != header.raw_bytes) {
+        LogLine(LOG_ERROR) << "Sidecar " << filename << " is corrupted.";
+        return false;
+    }
+
+    //// Index deltas, then the values
+    size_t count = (size_t)header.count, values_offset = raw.size() - count * sizeof(unsigned short), position = 0;
+    unsigned long long index = 0, pixels = (unsigned long long)header.width * header.height;
+    coordinates.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long delta = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (position >= values_offset || shift > 28) {
+                LogLine(LOG_ERROR) << "Sidecar " << filename << " is corrupted.";
+                coordinates.clear();
+                return false;
+            }
+            unsigned char byte = raw[position++];
+            delta |= (unsigned long long)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        index += delta;
+        if (index >= pixels) {
+            LogLine(LOG_ERROR) << "Sidecar " << filename << " has pixels outside the frame.";
+            coordinates.clear();
+            return false;
+        }
+        unsigned short value;
+        memcpy(&value, &raw[values_offset + i * sizeof(unsigned short)], sizeof(unsigned short));
+        coordinates[i].x = (int)(index % header.width);
+        coordinates[i].y = (int)(index / header.width);
+        coordinates[i].v = value;
+    }
+    if (position != values_offset) {
+        LogLine(LOG_ERROR) << "Sidecar " << filename << " is corrupted.";
+        coordinates.clear();
+        return false;
+    }
+    size = cv::Size((int)header.width, (int)header.height);
+    return true;
+}
+
+/************************
+Build the pipeline context from the config parameters.
+<config_parameters> is generated with GetConfigFile().
+Returns the PipelineContext with all the values needed by the pipeline stages.
+*************************/
+PipelineContext PipelineInit(const std::vector<ConfigParameters>& config_parameters) {
+    PipelineContext context;
+    context.config_parameters = config_parameters;
+    context.threshold = GetParameterValueFromConfig(config_parameters, "MasterThresholdHotPixels");
+    context.detection = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "HotPixelDetection"), DETECT_PIXELS), DETECT_TEMPORAL);
+    context.threshold_low = GetParameterValueFromConfig(config_parameters, "MasterThresholdLow");
+    if (context.threshold_low <= 0) context.threshold_low = context.threshold;
+    context.threshold_mode = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "ThresholdMode"), THRESHOLD_FIXED), THRESHOLD_PLATEAU);
+    context.threshold_percentile = GetParameterValueFromConfig(config_parameters, "ThresholdPercentile");
+    if (context.threshold_percentile <= 0 || context.threshold_percentile > 100) context.threshold_percentile = 99.99;
+    context.max_hot = (size_t)std::max(GetParameterValueFromConfig(config_parameters, "MaxHotPixels"), 0.0);
+    context.dilation = std::max((int)GetParameterValueFromConfig(config_parameters, "HotPixelDilation"), 0);
+    context.temporal_window = (int)GetParameterValueFromConfig(config_parameters, "TemporalWindow");
+    if (context.temporal_window <= 0) context.temporal_window = 16;
+    context.temporal_z = GetParameterValueFromConfig(config_parameters, "TemporalZThreshold");
+    if (context.temporal_z <= 0) context.temporal_z = 6.0;
+    std::string defect_file = GetTextFromConfig(config_parameters, "DefectMapFile");
+    if (!defect_file.empty()) DefectMapLoad(defect_file, context.defects);
+    context.brightness = GetParameterValueFromConfig(config_parameters, "SlaveBrightness");
+    context.contrast = GetParameterValueFromConfig(config_parameters, "SlaveContrast");
+    BuildBrightnessContrastLut(context.brightness, context.contrast, context.brightness_contrast_lut);
+    context.threads = (int)GetParameterValueFromConfig(config_parameters, "Threads");
+    context.interpolation = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "SlaveInterpolation"), SAMPLE_NEAREST), SAMPLE_BICUBIC);
+    context.sparse = GetParameterValueFromConfig(config_parameters, "SparseSlaveSampling") != 0;
+    context.rig = GetRigTransforms(config_parameters);
+    context.use_correspondence = GetParameterValueFromConfig(config_parameters, "CorrespondenceCache") != 0;
+    context.rig_hash = GetRigConfigHash(config_parameters);
+    context.stream_rows = std::max((int)GetParameterValueFromConfig(config_parameters, "StreamingBandRows"), 0);
+    context.output_mode = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "OutputMode"), OUTPUT_FRAME), OUTPUT_BOTH);
+    context.tiff_codec = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "OutputCompression"), TIFF_WRITE_ENCODER), TIFF_WRITE_ZSTD);
+    if (context.tiff_codec == TIFF_WRITE_ZSTD && !TIFF_HAVE_ZSTD) LogLine(LOG_WARNING) << "OutputCompression=2 needs a build with zstd (MULTICAM_HAVE_ZSTD), writing Deflate.";
+    context.tiff_level = std::max((int)GetParameterValueFromConfig(config_parameters, "OutputCompressionLevel"), 0);
+    context.tiff_rows_per_strip = (int)GetParameterValueFromConfig(config_parameters, "OutputRowsPerStrip");
+    if (context.tiff_rows_per_strip <= 0) context.tiff_rows_per_strip = 64;
+    //// Streaming bands are compressed strip by strip, a band has to end at the end of a strip
+    if (context.tiff_codec != TIFF_WRITE_ENCODER && context.stream_rows > 0) context.stream_rows = (context.stream_rows + context.tiff_rows_per_strip - 1) / context.tiff_rows_per_strip * context.tiff_rows_per_strip;
+    context.sidecar_level = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "SidecarDeflateLevel"), 0), 9);
+    std::string log_level = GetTextFromConfig(config_parameters, "LogLevel");
+    logger.Configure(log_level.empty() ? LOG_INFO : atoi(log_level.c_str()), GetTextFromConfig(config_parameters, "LogFile"));
+    //// Streaming scans each band with MasterThresholdHotPixels only, the other detection settings need the whole frame
+    if (context.stream_rows > 0) {
+        std::string whole_frame = context.detection != DETECT_PIXELS ? "HotPixelDetection" : context.threshold_mode != THRESHOLD_FIXED ? "ThresholdMode" : context.max_hot > 0 ? "MaxHotPixels" : !context.defects.points.empty() ? "DefectMapFile" : "";
+        if (!whole_frame.empty()) {
+            LogLine(LOG_WARNING) << "StreamingBandRows can't be used with " << whole_frame << ", decoding whole frames.";
+            context.stream_rows = 0;
+        }
+    }
+    context.instrumentation_file = GetTextFromConfig(config_parameters, "InstrumentationFile");
+    instrumentation.enabled = !context.instrumentation_file.empty();
+    if (GetParameterValueFromConfig(config_parameters, "Diagnostics") != 0) {
+        int depth = (int)GetParameterValueFromConfig(config_parameters, "DiagnosticsQueueDepth");
+        int scale = (int)GetParameterValueFromConfig(config_parameters, "DiagnosticsScale");
+        int annotations = (int)GetParameterValueFromConfig(config_parameters, "DiagnosticsMaxAnnotations");
+        context.diagnostics.reset(new Diagnostics(depth > 0 ? depth : 2, scale > 0 ? scale : 4, annotations > 0 ? annotations : 1000));
+    }
+    return context;
+}
+
+/************************
+Open image and decode it into a 16-bit grayscale buffer.
+<image_name> is a grayscale image file (.tif or .fit).
+<image> is where the CV_16UC1 buffer is stored.
+Returns true if execution was correct.
+*************************/
+bool ImageLoad(std::string image_name, cv::Mat& image) {
+    MagickWand* mw = NewMagickWand();
+    MagickSetType(mw, GrayscaleType);
+    if (!MagickReadImage(mw, image_name.c_str())) {
+        LogLine(LOG_ERROR) << "Could not open " << image_name << " image.";
+        mw = DestroyMagickWand(mw);
+        return false;
+    }
+
+    //// Export the intensity channel straight into the buffer as unsigned shorts
+    size_t width = MagickGetImageWidth(mw);
+    size_t height = MagickGetImageHeight(mw);
+    image.create((int)height, (int)width, CV_16UC1);
+    bool ok = MagickExportImagePixels(mw, 0, 0, width, height, "I", ShortPixel, image.data) == MagickTrue;
+    mw = DestroyMagickWand(mw);
+    if (!ok) {
+        LogLine(LOG_ERROR) << "Could not decode pixels of " << image_name << " image.";
+        return false;
+    }
+    LogLine(LOG_INFO) << "Opening file: " << image_name << "... OK!";
+    return true;
+}
+
+/************************
+Encode a 16-bit grayscale buffer into an image file.
+<image_name> is the output file, the format is taken from the extension.
+<image> is the CV_16UC1 buffer to save.
+Returns true if execution was correct.
+*************************/
+bool ImageSave(std::string image_name, const cv::Mat& image) {
+    cv::Mat continuous = image.isContinuous() ? image : image.clone();
+    MagickWand* mw = NewMagickWand();
+    bool ok = MagickConstituteImage(mw, continuous.cols, continuous.rows, "I", ShortPixel, continuous.data) == MagickTrue;
+    if (ok) {
+        MagickSetImageDepth(mw, 16);
+        MagickSetImageType(mw, GrayscaleType);
+        ok = MagickWriteImage(mw, image_name.c_str()) == MagickTrue;
+    }
+    mw = DestroyMagickWand(mw);
+    if (ok) {
+        LogLine(LOG_INFO) << "wrote final file in " << image_name << "... DONE.";
+    }
+    else {
+        LogLine(LOG_ERROR) << "Couldn't write output file " << image_name << ".";
+    }
+    return ok;
+}
+
+//Read rows of a 16-bit grayscale TIFF, decoding only the strips or tiles that hold them. Decoded strips (or rows of tiles) are kept while the next requests still use them.
+class TiffBandReader {
+public:
+    int width, height; //size of the image
+    uint16_t compression, predictor; //TIFF compression and predictor of the image
+    std::string filename; //name of the opened image
+
+    TiffBandReader() : width(0), height(0), compression(COMPRESSION_NONE), predictor(PREDICTOR_NONE), tif(NULL), tiled(false), block_width(0), block_height(0) {}
+    ~TiffBandReader() { Close(); }
+
+    /************************
+    Open a TIFF image for reading by rows.
+    <filename> is the image.
+    Returns true if the image is a 16-bit unsigned grayscale TIFF (one sample per pixel, min-is-black), the only layout read by rows.
+    *************************/
+    bool Open(std::string filename) {
+        Close();
+        //// Check the TIFF signature first, libtiff reports an error for other formats
+        unsigned char signature[4] = { 0, 0, 0, 0 };
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (!file) return false;
+        size_t length = fread(signature, 1, 4, file);
+        fclose(file);
+        if (length < 4 || !((signature[0] == 'I' && signature[1] == 'I' && signature[3] == 0) || (signature[0] == 'M' && signature[1] == 'M' && signature[2] == 0))) return false;
+        tif = TIFFOpen(filename.c_str(), "r");
+        if (!tif) return false;
+        this->filename = filename;
+        uint32_t w = 0, h = 0;
+        uint16_t bits = 0, samples = 0, format = 0, photometric = 0, planar = 0;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+        //The predictor tag belongs to the LZW, Deflate and ZSTD codecs, libtiff warns when it is asked to other codecs
+        predictor = PREDICTOR_NONE;
+        if (compression == COMPRESSION_LZW || compression == COMPRESSION_ADOBE_DEFLATE || compression == COMPRESSION_DEFLATE || compression == COMPRESSION_ZSTD) TIFFGetField(tif, TIFFTAG_PREDICTOR, &predictor);
+        if (!TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric)) photometric = PHOTOMETRIC_MINISBLACK;
+        if (bits != 16 || samples != 1 || format != SAMPLEFORMAT_UINT || photometric != PHOTOMETRIC_MINISBLACK || planar != PLANARCONFIG_CONTIG || w == 0 || h == 0) {
+            Close();
+            return false;
+        }
+        width = (int)w;
+        height = (int)h;
+        tiled = TIFFIsTiled(tif) != 0;
+        uint32_t bw = w, bh = 0;
+        if (tiled) {
+            TIFFGetField(tif, TIFFTAG_TILEWIDTH, &bw);
+            TIFFGetField(tif, TIFFTAG_TILELENGTH, &bh);
+        }
+        else {
+            TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &bh);
+        }
+        block_width = (int)bw;
+        block_height = (int)std::min(std::max(bh, (uint32_t)1), h);
+        return true;
+    }
+
+    /************************
+    Read rows of the image. Requests with increasing rows are the fastest, strips above the requested rows are released.
+    <first_row> and <end_row> are the first row and the row after the last one.
+    <rows> receives a CV_16UC1 buffer with end_row - first_row rows.
+    Returns true if execution was correct.
+    *************************/
+    bool ReadRows(int first_row, int end_row, cv::Mat& rows) {
+        rows.create(std::max(end_row - first_row, 0), width, CV_16UC1);
+        int first_block = first_row / block_height, end_block = (end_row + block_height - 1) / block_height;
+        for (std::map<int, cv::Mat>::iterator it = blocks.begin(); it != blocks.end();) {
+            if (it->first < first_block || it->first >= end_block) blocks.erase(it++);
+            else ++it;
+        }
+        for (int y = first_row; y < end_row;) {
+            int b = y / block_height;
+            if (!blocks.count(b) && !ReadBlock(b)) return false;
+            const cv::Mat& block = blocks[b];
+            int end = std::min(end_row, b * block_height + block.rows);
+            cv::Mat target = rows.rowRange(y - first_row, end - first_row);
+            block.rowRange(y - b * block_height, end - b * block_height).copyTo(target);
+            y = end;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (tif) TIFFClose(tif);
+        tif = NULL;
+        blocks.clear();
+    }
+
+    //libtiff handle of the opened image, NULL if not opened
+    TIFF* Handle() const { return tif; }
+
+private:
+    TiffBandReader(const TiffBandReader&);
+    TiffBandReader& operator=(const TiffBandReader&);
+
+    //Decode a strip, or a row of tiles, into blocks
+    bool ReadBlock(int b) {
+        int rows = std::min(block_height, height - b * block_height);
+        cv::Mat block(rows, width, CV_16UC1);
+        if (!tiled) {
+            if (TIFFReadEncodedStrip(tif, (tstrip_t)b, block.ptr(0), (tmsize_t)rows * width * sizeof(unsigned short)) < 0) return false;
+        }
+        else {
+            std::vector<unsigned short> tile((size_t)block_width * block_height);
+            for (int x = 0; x < width; x += block_width) {
+                if (TIFFReadEncodedTile(tif, TIFFComputeTile(tif, x, b * block_height, 0, 0), &tile[0], (tmsize_t)tile.size() * sizeof(unsigned short)) < 0) return false;
+                int columns = std::min(block_width, width - x);
+                for (int y = 0; y < rows; y++) memcpy(block.ptr<unsigned short>(y) + x, &tile[(size_t)y * block_width], columns * sizeof(unsigned short));
+            }
+        }
+        blocks[b] = block;
+        return true;
+    }
+
+    TIFF* tif;
+    bool tiled;
+    int block_width, block_height; //size of a tile, or width of the image and rows per strip
+    std::map<int, cv::Mat> blocks; //decoded strips or rows of tiles, by index
+};
+
+/************************
+Write a 16-bit grayscale TIFF row by row, each strip is encoded as soon as its rows are written.
+<filename> is the output image.
+<like> is the reader of the master image, the output has its size and compression (none, LZW, Deflate or PackBits, otherwise none).
+Returns the TIFF handle, NULL on error.
+*************************/
+TIFF* TiffOpenBandWriter(std::string filename, const TiffBandReader& like) {
+    TIFF* tif = TIFFOpen(filename.c_str(), "w");
+    if (!tif) return NULL;
+    uint16_t compression = like.compression;
+    if (compression != COMPRESSION_LZW && compression != COMPRESSION_ADOBE_DEFLATE && compression != COMPRESSION_DEFLATE && compression != COMPRESSION_PACKBITS) compression = COMPRESSION_NONE;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t)like.width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t)like.height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t)16);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t)1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, (uint16_t)SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, (uint16_t)PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, (uint16_t)PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, (uint16_t)ORIENTATION_TOPLEFT);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+    if (compression != COMPRESSION_NONE && compression != COMPRESSION_PACKBITS && like.predictor == PREDICTOR_HORIZONTAL) TIFFSetField(tif, TIFFTAG_PREDICTOR, like.predictor);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+    return tif;
+}
+
+/************************
+Check if a file name has a TIFF extension (.tif or .tiff).
+<filename> is the file name.
+Returns true for TIFF file names.
+*************************/
+bool IsTiffFile(std::string filename) {
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos) return false;
+    std::string extension = filename.substr(dot + 1);
+    for (size_t i = 0; i < extension.size(); i++) extension[i] = (char)tolower(extension[i]);
+    return extension == "tif" || extension == "tiff";
+}
+
+/************************
+Open a 16-bit grayscale TIFF whose strips are compressed by the caller and written with TiffWriteStrips().
+<filename> is the output image.
+<width> and <height> are the size of the image.
+<codec> is TIFF_WRITE_DEFLATE or TIFF_WRITE_ZSTD (Deflate if built without zstd).
+<rows_per_strip> is the number of rows of every strip but the last.
+Returns the TIFF handle, NULL on error.
+*************************/
+TIFF* TiffOpenStripWriter(std::string filename, int width, int height, int codec, int rows_per_strip) {
+    TIFF* tif = TIFFOpen(filename.c_str(), "w");
+    if (!tif) return NULL;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t)width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t)height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t)16);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t)1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, (uint16_t)SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, (uint16_t)PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, (uint16_t)PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, (uint16_t)ORIENTATION_TOPLEFT);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, (uint16_t)(codec == TIFF_WRITE_ZSTD && TIFF_HAVE_ZSTD ? COMPRESSION_ZSTD : COMPRESSION_ADOBE_DEFLATE));
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)PREDICTOR_HORIZONTAL);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t)rows_per_strip);
+    return tif;
+}
+
+/************************
+Compress one strip of a 16-bit grayscale buffer: horizontal predictor (every pixel minus the previous one of its row), then deflate or zstd, as a TIFF reader expects it.
+<image> is the CV_16UC1 buffer.
+<first_row> and <end_row> are the rows of the strip, end_row not included.
+<codec> is TIFF_WRITE_DEFLATE or TIFF_WRITE_ZSTD.
+<level> is the level of the codec, 0 for its default.
+<scratch> is a buffer for the differences, reused between strips.
+<strip> receives the compressed strip.
+Returns true if execution was correct.
+*************************/
+bool TiffEncodeStrip(const cv::Mat& image, int first_row, int end_row, int codec, int level, std::vector<unsigned short>& scratch, std::vector<unsigned char>& strip) {
+    scratch.resize((size_t)(end_row - first_row) * image.cols);
+    for (int y = first_row; y < end_row; y++) {
+        const unsigned short* row = image.ptr<unsigned short>(y);
+        unsigned short* difference = &scratch[(size_t)(y - first_row) * image.cols];
+        difference[0] = row[0];
+        for (int x = 1; x < image.cols; x++) difference[x] = (unsigned short)(row[x] - row[x - 1]);
+    }
+    size_t bytes = scratch.size() * sizeof(unsigned short);
+#ifdef MULTICAM_HAVE_ZSTD
+    if (codec == TIFF_WRITE_ZSTD) {
+        strip.resize(ZSTD_compressBound(bytes));
+        size_t written = ZSTD_compress(&strip[0], strip.size(), &scratch[0], bytes, level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(written)) return false;
+        strip.resize(written);
+        return true;
+    }
+#endif
+    uLongf written = compressBound((uLong)bytes);
+    strip.resize(written);
+    if (compress2(&strip[0], &written, (const Bytef*)&scratch[0], (uLong)bytes, level > 0 ? std::min(level, 9) : Z_DEFAULT_COMPRESSION) != Z_OK) return false;
+    strip.resize(written);
+    return true;
+}
+
+/************************
+Compress the strips of a block of rows in parallel and write them in order.
+<tif> is opened with TiffOpenStripWriter().
+<rows> is the CV_16UC1 buffer of the rows, starting at the first row of strip <first_strip>.
+<first_strip> is the index of the first strip of <rows> in the image.
+<codec> and <level> are the compression of TiffOpenStripWriter() and its level, 0 for the default.
+<rows_per_strip> is the value given to TiffOpenStripWriter().
+<threads> is the number of strips compressed at the same time, 0 for all the cores.
+Returns true if execution was correct.
+*************************/
+bool TiffWriteStrips(TIFF* tif, const cv::Mat& rows, uint32_t first_strip, int codec, int level, int rows_per_strip, int threads = 1) {
+    int strips = (rows.rows + rows_per_strip - 1) / rows_per_strip;
+    std::vector<std::vector<unsigned char> > encoded(strips);
+    std::atomic<bool> ok(true);
+    ParallelBands(strips, threads, [&](int band, int first_strip_of_band, int end_strip) {
+        std::vector<unsigned short> scratch;
+        for (int strip = first_strip_of_band; strip < end_strip && ok; strip++) {
+            if (!TiffEncodeStrip(rows, strip * rows_per_strip, std::min((strip + 1) * rows_per_strip, rows.rows), codec, level, scratch, encoded[strip])) ok = false;
+        }
+    });
+    for (int strip = 0; strip < strips && ok; strip++) {
+        if (TIFFWriteRawStrip(tif, first_strip + strip, &encoded[strip][0], (tmsize_t)encoded[strip].size()) < 0) ok = false;
+    }
+    return ok;
+}
+
+/************************
+Encode a 16-bit grayscale buffer as a compressed TIFF, its strips compressed in parallel.
+<image_name> is the output file.
+<image> is the CV_16UC1 buffer to save.
+<codec> is TIFF_WRITE_DEFLATE or TIFF_WRITE_ZSTD.
+<level> is the level of the codec, 0 for its default.
+<rows_per_strip> is the number of rows compressed together.
+<threads> is the number of strips compressed at the same time, 0 for all the cores.
+Returns true if execution was correct.
+*************************/
+bool TiffSaveStrips(std::string image_name, const cv::Mat& image, int codec, int level, int rows_per_strip, int threads = 1) {
+    TIFF* tif = TiffOpenStripWriter(image_name, image.cols, image.rows, codec, rows_per_strip);
+    bool ok = tif && TiffWriteStrips(tif, image, 0, codec, level, rows_per_strip, threads);
+    if (tif) TIFFClose(tif);
+    if (ok) {
+        LogLine(LOG_INFO) << "wrote final file in " << image_name << "... DONE.";
+    }
+    else {
+        LogLine(LOG_ERROR) << "Couldn't write output file " << image_name << ".";
+    }
+    return ok;
+}
+
+/************************
+Find the pixels of an uncompressed 16-bit grayscale TIFF in the file, i.e. the layout written by the detector cameras.
+<image_name> is the TIFF image.
+<offset> receives the position of the first pixel in the file.
+<size> receives the size of the image.
+Returns true if the pixels are stored as one block of unsigned shorts in the byte order of this machine (no compression, strips one after the other), false for any other layout or format.
+*************************/
+bool TiffGetRawLayout(std::string image_name, size_t& offset, cv::Size& size) {
+    TiffBandReader reader;
+    if (!reader.Open(image_name) || reader.compression != COMPRESSION_NONE) return false;
+    TIFF* tif = reader.Handle();
+    if (TIFFIsTiled(tif) || TIFFIsByteSwapped(tif)) return false;
+    uint64_t next = TIFFGetStrileOffset(tif, 0);
+    offset = (size_t)next;
+    for (uint32_t strip = 0; strip < TIFFNumberOfStrips(tif); strip++) {
+        if (TIFFGetStrileOffset(tif, strip) != next) return false;
+        next += TIFFGetStrileByteCount(tif, strip);
+    }
+    size = cv::Size(reader.width, reader.height);
+    return offset % sizeof(unsigned short) == 0 && next - offset == (uint64_t)reader.width * reader.height * sizeof(unsigned short);
+}
+
+/************************
+Map an uncompressed 16-bit grayscale TIFF in memory and use its pixels as the buffer, without decoding or copying them.
+<image_name> is the TIFF image.
+<image> receives a read-only CV_16UC1 view of the pixels in the mapped file.
+<file> receives the mapping, the view is valid while it is kept.
+Returns true if the image was mapped, false if its layout needs the generic decoder (see TiffGetRawLayout()).
+*************************/
+bool ImageMap(std::string image_name, cv::Mat& image, std::shared_ptr<MappedFile>& file) {
+    size_t offset;
+    cv::Size size;
+    if (!TiffGetRawLayout(image_name, offset, size)) return false;
+    std::shared_ptr<MappedFile> mapped(new MappedFile());
+    if (!mapped->Open(image_name, false) || offset + (size_t)size.area() * sizeof(unsigned short) > mapped->size) return false;
+    image = cv::Mat(size, CV_16UC1, mapped->data + offset);
+    file = mapped;
+    LogLine(LOG_INFO) << "Mapped file: " << image_name << "... OK!";
+    return true;
+}
+
+/************************
+Write the corrected master as a copy of the input file with only the corrected pixels changed, instead of encoding the whole image.
+<infilename> is an uncompressed 16-bit grayscale TIFF (see TiffGetRawLayout()).
+<outfilename> is the corrected image.
+<coordinates> has the coordinates and value of the pixels to set. Coordinates with negative value are skipped.
+<threads> is the number of row bands processed in parallel, 0 for all the cores.
+Returns true if execution was correct.
+*************************/
+bool ImagePatchCopy(std::string infilename, std::string outfilename, const std::vector<Coords>& coordinates, int threads = 1) {
+    size_t offset;
+    cv::Size size;
+    MappedFile input, output;
+    if (!TiffGetRawLayout(infilename, offset, size) || !input.Open(infilename, false)) return false;
+
+    //// Copy the file as it is, then set the values in the mapped copy
+    FILE* file = fopen(outfilename.c_str(), "wb");
+    bool ok = file && fwrite(input.data, 1, input.size, file) == input.size;
+    if (file && fclose(file) != 0) ok = false;
+    ok = ok && output.Open(outfilename, true);
+    if (ok) {
+        cv::Mat image(size, CV_16UC1, output.data + offset);
+        BufferSetValues(image, coordinates, threads);
+    }
+    output.Close();
+    if (ok) {
+        LogLine(LOG_INFO) << "wrote final file in " << outfilename << "... DONE.";
+    }
+    else {
+        LogLine(LOG_ERROR) << "Couldn't write output file " << outfilename << ".";
+    }
+    return ok;
+}
+
+/************************
+Look for pixel coordinates with values higher or equal to threshold in a decoded image.
+<image> is a CV_16UC1 buffer.
+<threshold> is the value from 0-65535 (black to white).
+<threads> is the number of row bands scanned in parallel, 0 for all the cores.
+Returns vector of points containing coordinates of points with value above or equal to threshold, in raster order.
+*************************/
+std::vector<cv::Point2f> BufferGetHotPoints(const cv::Mat& image, long threshold, int threads = 1) {
+    std::vector<unsigned int> indices;
+    BufferGetHotIndices(image, threshold, indices, threads);
+    std::vector<cv::Point2f> hotpoints = IndicesToPoints(indices, image.cols);
+    LogLine(LOG_INFO) << "Looking for hot pixels with value >=" << threshold << "... " << hotpoints.size() << " found!";
+    return hotpoints;
+}
+
+/************************
+Transform a decoded image to rotate and compensate perspective distortion.
+<image_type> is either "Slave" or "Master".
+<input> is the CV_16UC1 buffer to transform.
+<config_parameters> contains the table of pixel coordinates. It is generated with GetConfigFile().
+<output> is where the flat image is stored.
+Returns true if execution was correct.
+*************************/
+bool BufferRotateAndPerspectiveTransformation(std::string image_type, const cv::Mat& input, const std::vector<ConfigParameters>& config_parameters, cv::Mat& output) {
+    cv::Mat matrix = GetRotationAndPerspectiveMatrix(image_type, config_parameters);
+    warpPerspective(input, output, matrix, input.size());
+    LogLine(LOG_INFO) << "Rotating " << image_type << " image with " << GetParameterValueFromConfig(config_parameters, image_type + "Rotation") << " degrees and applying Perspective Transformation... OK!";
+    return true;
+}
+
+/************************
+Adjusts Brightness and Constrast of a decoded image in place, with the same transfer function as ImageAdjustBrightnessContrast().
+<image> is the CV_16UC1 buffer to adjust.
+<brightness> is a value in percent -100 to 100.
+<contrast> is a value in percent -100 to 100.
+<threads> is the number of row bands processed in parallel, 0 for all the cores.
+Returns true if the execution was correct.
+*************************/
+bool BufferAdjustBrightnessContrast(cv::Mat& image, double brightness, double contrast, int threads = 1) {
+    std::vector<unsigned short> lut;
+    BuildBrightnessContrastLut(brightness, contrast, lut);
+    BufferApplyLut(image, lut, threads);
+    LogLine(LOG_INFO) << "Adjusting Brightness " << brightness << "% and contrast " << contrast << "%... OK!";
+    return true;
+}
+
+/************************
+Adjusts Brightness and Constrast of a list of values only, with the same transfer function used for whole images.
+<coordinates> has the values to adjust in place. Coordinates with negative value are skipped.
+<brightness> is a value in percent -100 to 100.
+<contrast> is a value in percent -100 to 100.
+Returns true if the execution was correct.
+*************************/
+bool ValuesAdjustBrightnessContrast(std::vector<Coords>& coordinates, double brightness, double contrast) {
+    std::vector<unsigned short> lut;
+    BuildBrightnessContrastLut(brightness, contrast, lut);
+    ValuesApplyLut(coordinates, lut);
+    return true;
+}
+
+/************************
+Transform points of the master raw image straight to coordinates of the slave raw image, without going through the flat images.
+<hotpoints> is the input vector of master raw points.
+<rig> is generated with GetRigTransforms().
+Returns vector of points in slave raw coordinates, in the same order as <hotpoints>.
+*************************/
+std::vector<cv::Point2f> PointsMasterToSlave(const std::vector<cv::Point2f>& hotpoints, const RigTransforms& rig) {
+    std::vector<cv::Point2f> slavepoints;
+    if (hotpoints.empty()) return slavepoints;
+    perspectiveTransform(hotpoints, slavepoints, rig.master_to_slave);
+    return slavepoints;
+}
+
+/************************
+Prepare the defect map for the frame size: raster indices, bitset, and the defects in slave raw and flat coordinates, so they are never detected or transformed again.
+<defects> is loaded with DefectMapLoad(). It is emptied if it was built for another sensor size.
+<size> is the size of the master frames.
+<rig> has the matrices of the rig.
+*************************/
+void DefectMapPrepare(DefectMap& defects, cv::Size size, const RigTransforms& rig) {
+    if (defects.size.area() != 0 && defects.size != size) {
+        LogLine(LOG_WARNING) << "Defect map is for " << defects.size.width << "x" << defects.size.height << " images, not used.";
+        defects = DefectMap();
+        return;
+    }
+    defects.size = size;
+    defects.indices.clear();
+    for (size_t i = 0; i < defects.points.size(); i++) {
+        int x = (int)defects.points[i].x, y = (int)defects.points[i].y;
+        if (x >= 0 && y >= 0 && x < size.width && y < size.height) defects.indices.push_back((unsigned int)y * size.width + x);
+    }
+    std::sort(defects.indices.begin(), defects.indices.end());
+    defects.indices.erase(std::unique(defects.indices.begin(), defects.indices.end()), defects.indices.end());
+    defects.bits.assign(((size_t)size.area() + 63) / 64, 0);
+    for (size_t i = 0; i < defects.indices.size(); i++) defects.bits[defects.indices[i] >> 6] |= 1ULL << (defects.indices[i] & 63);
+    defects.points = IndicesToPoints(defects.indices, size.width);
+    defects.slave_points = PointsMasterToSlave(defects.points, rig);
+    defects.flat_points.clear();
+    if (!defects.points.empty()) perspectiveTransform(defects.points, defects.flat_points, rig.master);
+    LogLine(LOG_INFO) << defects.indices.size() << " known defects from the defect map.";
+}
+
+/************************
+Remove the known defects from a list of hot pixels.
+<indices> are the raster indices of hot pixels, updated in place.
+<defects> is prepared with DefectMapPrepare().
+*************************/
+void IndicesRemoveDefects(std::vector<unsigned int>& indices, const DefectMap& defects) {
+    if (defects.indices.empty()) return;
+    size_t kept = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (!defects.Contains(indices[i])) indices[kept++] = indices[i];
+    }
+    indices.resize(kept);
+}
+
+/************************
+Remove the known defects from a run-length encoded mask, splitting the runs that hold them.
+<runs> is the mask, updated in place.
+<defects> is prepared with DefectMapPrepare().
+*************************/
+void RunsRemoveDefects(std::vector<PixelRun>& runs, const DefectMap& defects) {
+    if (defects.indices.empty()) return;
+    std::vector<PixelRun> kept;
+    kept.reserve(runs.size());
+    for (size_t i = 0; i < runs.size(); i++) {
+        unsigned int base = (unsigned int)runs[i].y * defects.size.width;
+        PixelRun run = { runs[i].y, runs[i].x0, runs[i].x0 };
+        for (int x = runs[i].x0; x < runs[i].x1; x++) {
+            if (!defects.Contains(base + x)) {
+                run.x1 = x + 1;
+                continue;
+            }
+            if (run.x1 > run.x0) kept.push_back(run);
+            run.x0 = run.x1 = x + 1;
+        }
+        if (run.x1 > run.x0) kept.push_back(run);
+    }
+    runs.swap(kept);
+}
+
+/************************
+Pipeline stage: decode master and slave images of the pair, the slave on its own thread while the master is decoded. Uncompressed 16-bit TIFF images are mapped instead of decoded (see ImageMap()) and 16-bit FITS images are read directly (see FitsLoad()).
+<pair> has the file names to read and receives the decoded buffers.
+<threads> is the number of threads of the pipeline, 0 for all the cores. With 1 the images are decoded one after the other.
+Returns true if execution was correct.
+*************************/
+bool PipelineDecode(FramePair& pair, int threads = 1) {
+    StageTimer timer("decode", pair.master_file);
+    pair.master_map.reset();
+    pair.slave_map.reset();
+    pair.slaveflat.release();
+    pair.slave_prepared = false;
+    pair.master_fits = false;
+    bool slave_ok = false;
+    double slave_cpu_ms = 0;
+    auto decode_slave = [&]() {
+        slave_ok = ImageMap(pair.slave_file, pair.slave, pair.slave_map) || FitsLoad(pair.slave_file, pair.slave) || ImageLoad(pair.slave_file, pair.slave);
+    };
+    std::thread slave_decoder;
+    if (GetThreadCount(threads) > 1) {
+        slave_decoder = std::thread([&]() {
+            decode_slave();
+            slave_cpu_ms = GetThreadCpuMs();
+        });
+    }
+    bool ok = ImageMap(pair.master_file, pair.master, pair.master_map);
+    if (!ok) {
+        pair.master_fits = FitsLoad(pair.master_file, pair.master);
+        ok = pair.master_fits || ImageLoad(pair.master_file, pair.master);
+    }
+    if (slave_decoder.joinable()) {
+        slave_decoder.join();
+        worker_cpu_ms += slave_cpu_ms;
+    }
+    else if (ok) decode_slave();
+    ok = ok && slave_ok;
+    if (timer.running) {
+        timer.record.bytes_read = GetFileSize(pair.master_file) + GetFileSize(pair.slave_file);
+        timer.record.pixels = pair.master.total() + pair.slave.total();
+    }
+    return ok;
+}
+
+/************************
+Pipeline stage: find hot pixels in the master buffer.
+<pair> has the decoded master buffer and receives the hotpoints.
+<context> is generated with PipelineInit(). With HotPixelDetection=2 the pixel history in it is updated, so pairs must come in acquisition order.
+Returns true if execution was correct.
+*************************/
+bool PipelineDetect(FramePair& pair, PipelineContext& context) {
+    StageTimer timer("detect", pair.master_file);
+    timer.record.pixels = pair.master.total();
+    LogLine(LOG_INFO) << "FIND HOT PIXELS IN " << pair.master_file;
+    pair.hotpoints.clear();
+    pair.hotruns.clear();
+    if (!context.defects.points.empty() && (context.defects.bits.empty() || context.defects.size != pair.master.size())) DefectMapPrepare(context.defects, pair.master.size(), context.rig);
+    if (context.detection == DETECT_STREAKS) {
+        BufferGetHotRuns(pair.master, context.threshold_low, context.threshold, context.dilation, pair.hotruns);
+        RunsRemoveDefects(pair.hotruns, context.defects);
+        timer.record.hot = RunsPixelCount(pair.hotruns);
+        LogLine(LOG_INFO) << "Streaks with pixels >=" << context.threshold_low << " reaching " << context.threshold << ": " << pair.hotruns.size() << " runs with " << timer.record.hot << " pixels found!";
+        return true;
+    }
+    std::vector<unsigned int> indices;
+    long threshold = context.threshold;
+    if (context.detection == DETECT_TEMPORAL) {
+        BufferTemporalHotIndices(pair.master, context.temporal, context.temporal_window, context.temporal_z, context.threshold, indices, context.threads);
+    }
+    else if (context.threshold_mode != THRESHOLD_FIXED) {
+        BufferGetAdaptiveHotIndices(pair.master, context.threshold_mode, context.threshold_percentile, context.threshold_low, context.threshold, indices, threshold, context.threads);
+    }
+    else {
+        BufferGetHotIndices(pair.master, context.threshold, indices, context.threads);
+    }
+    IndicesRemoveDefects(indices, context.defects);
+    size_t found = indices.size();
+    long capped = IndicesApplyCap(pair.master, context.max_hot, indices);
+    if (capped >= 0) LogLine(LOG_WARNING) << found << " hot pixels in " << pair.master_file << " exceed MaxHotPixels=" << context.max_hot << ", only the " << indices.size() << " brightest (value >=" << capped << ") are corrected.";
+    pair.hotpoints = IndicesToPoints(indices, pair.master.cols);
+    timer.record.hot = pair.hotpoints.size();
+    if (context.detection == DETECT_TEMPORAL) LogLine(LOG_INFO) << "Pixels " << context.temporal_z << " sigma above their last " << context.temporal_window << " frames (frame " << context.temporal.frames << "): " << found << " found!";
+    else if (context.threshold_mode != THRESHOLD_FIXED) LogLine(LOG_INFO) << "Hot pixels with value >=" << threshold << " (" << (context.threshold_mode == THRESHOLD_PLATEAU ? "saturation plateau" : "percentile") << " threshold of the frame): " << found << " found!";
+    else LogLine(LOG_INFO) << "Hot pixels with value >=" << context.threshold << ": " << found << " found!";
+    return true;
+}
+
+/************************
+Pipeline stage: prepare the slave for sampling. It does not need the hot pixels, so PipelineRun() runs it while they are detected in the master.
+Dense sampling warps the slave with the remap maps of the rig, in row bands on all the threads, and adjusts its brightness and contrast. The correspondence cache is mapped for the image sizes. Sparse sampling needs nothing.
+<pair> has the decoded master and slave buffers, and receives the flat slave for dense sampling.
+<context> is generated with PipelineInit(). The slave remap maps and the correspondence table are built in it on first use.
+Returns true if execution was correct.
+*************************/
+bool PipelinePrepareSlave(FramePair& pair, PipelineContext& context) {
+    pair.slave_prepared = true;
+    if (context.use_correspondence) {
+        if (context.correspondence.width != pair.master.cols || context.correspondence.height != pair.master.rows ||
+            context.correspondence.slave_width != pair.slave.cols || context.correspondence.slave_height != pair.slave.rows) {
+            return LoadCorrespondenceTable(context.rig, context.rig_hash, pair.master.size(), pair.slave.size(), context.correspondence);
+        }
+        return true;
+    }
+    if (context.sparse) return true;
+
+    //// Single remap pass with the maps of the rig, built once for the slave image size
+    StageTimer timer("warp", pair.master_file);
+    if (context.slave_maps.size != pair.slave.size()) {
+        BuildRemapTables(context.rig.slave, pair.slave.size(), context.slave_maps, context.threads);
+    }
+    BufferRemap(pair.slave, pair.slaveflat, context.slave_maps, context.threads);
+    BufferApplyLut(pair.slaveflat, context.brightness_contrast_lut, context.threads);
+    timer.record.pixels = pair.slaveflat.total();
+    LogLine(LOG_INFO) << "TRANSFORMATION OF Slave IMAGE OK!";
+    return true;
+}
+
+/************************
+Pipeline stage: take the replacement value of every hot pixel from the slave, flattened and adjusted by PipelinePrepareSlave() for dense sampling.
+<pair> has the decoded slave buffer and the hotpoints or hotruns, and receives the corrections (runvalues for hotruns).
+<context> is generated with PipelineInit().
+Returns true if execution was correct.
+*************************/
+bool PipelineSample(FramePair& pair, PipelineContext& context) {
+    if (!pair.slave_prepared && !PipelinePrepareSlave(pair, context)) return false;
+    StageTimer timer("sample", pair.master_file);
+    const unsigned short* lut = &context.brightness_contrast_lut[0];
+    const cv::Mat& slaveflat = pair.slaveflat;
+    std::function<void(const std::vector<cv::Point2f>&, std::vector<int>&)> sample;
+    if (context.use_correspondence) {
+        //// One lookup per hotpoint in the mapped correspondence table of the rig
+        LogLine(LOG_INFO) << "SAMPLING OF Slave IMAGE WITH CORRESPONDENCE CACHE";
+        sample = [&](const std::vector<cv::Point2f>& points, std::vector<int>& values) {
+            std::vector<Coords> coordvalues = CorrespondenceGetValues(context.correspondence, pair.slave, points);
+            values.resize(coordvalues.size());
+            for (size_t i = 0; i < coordvalues.size(); i++) values[i] = coordvalues[i].v >= 0 ? lut[coordvalues[i].v] : -1;
+        };
+    }
+    else if (context.sparse) {
+        //// Take hotpoints straight to the slave raw image, sample and adjust brightness and contrast only there
+        LogLine(LOG_INFO) << "SPARSE SAMPLING OF Slave IMAGE";
+        sample = [&](const std::vector<cv::Point2f>& points, std::vector<int>& values) {
+            std::vector<cv::Point2f> slavepoints = PointsMasterToSlave(points, context.rig);
+            BufferGatherValues(pair.slave, slavepoints, context.interpolation, values, lut);
+        };
+    }
+    else {
+        //// Transform hotpoints to the flat image and read the slave values there
+        sample = [&](const std::vector<cv::Point2f>& points, std::vector<int>& values) {
+            std::vector<cv::Point2f> flatpoints;
+            if (!points.empty()) perspectiveTransform(points, flatpoints, context.rig.master);
+            BufferGatherValues(slaveflat, flatpoints, context.interpolation, values);
+        };
+    }
+
+    std::vector<int> values;
+    pair.corrections.clear();
+    pair.runvalues.clear();
+    if (!pair.hotruns.empty()) {
+        //// Streaks: one value per pixel of the mask, the runs keep the coordinates
+        RunsGetValues(pair.hotruns, sample, pair.runvalues);
+    }
+    else {
+        //// Dump values to hotpoint coordinates, both vectors have the same order
+        sample(pair.hotpoints, values);
+        pair.corrections.resize(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            pair.corrections[i].x = (int)pair.hotpoints[i].x;
+            pair.corrections[i].y = (int)pair.hotpoints[i].y;
+            pair.corrections[i].v = values[i];
+        }
+    }
+
+    //// Known defects, with the slave and flat coordinates computed once
+    const DefectMap& defects = context.defects;
+    if (!defects.indices.empty()) {
+        if (context.use_correspondence) sample(defects.points, values);
+        else if (context.sparse) BufferGatherValues(pair.slave, defects.slave_points, context.interpolation, values, lut);
+        else BufferGatherValues(slaveflat, defects.flat_points, context.interpolation, values);
+        size_t detected = pair.corrections.size();
+        pair.corrections.resize(detected + values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            pair.corrections[detected + i].x = (int)defects.points[i].x;
+            pair.corrections[detected + i].y = (int)defects.points[i].y;
+            pair.corrections[detected + i].v = values[i];
+        }
+        //// Keep the corrections in row order for the parallel scatter
+        std::inplace_merge(pair.corrections.begin(), pair.corrections.begin() + detected, pair.corrections.end(), [](const Coords& a, const Coords& b) { return a.y < b.y; });
+    }
+    timer.record.pixels = pair.corrections.size() + pair.runvalues.size();
+    timer.record.hot = timer.record.pixels;
+    return true;
+}
+
+/************************
+Pipeline stage: set the corrections in the master buffer and encode it, and/or write them as a sidecar of the output file (OutputMode in the config file).
+<pair> has the master buffer, the corrections and runvalues, and the output file name.
+<context> is generated with PipelineInit().
+Returns true if execution was correct.
+*************************/
+bool PipelineEncode(FramePair& pair, const PipelineContext& context) {
+    StageTimer timer("encode", pair.master_file);
+    timer.record.pixels = timer.record.hot = pair.corrections.size() + pair.runvalues.size();
+    bool compress = context.tiff_codec != TIFF_WRITE_ENCODER && IsTiffFile(pair.output_file);
+    bool patch = (pair.master_map && !compress) || (pair.master_fits && IsFitsFile(pair.output_file));
+    //// Streaks are set run by run in the buffer, the sidecar and the patched copies take one coordinate per pixel
+    if (!pair.hotruns.empty() && (context.output_mode != OUTPUT_FRAME || patch)) {
+        RunsAddCorrections(pair.hotruns, pair.runvalues, pair.corrections);
+        pair.hotruns.clear();
+        pair.runvalues.clear();
+    }
+    if (context.output_mode != OUTPUT_FRAME) {
+        std::string sidecar_file = SidecarFileName(pair.output_file);
+        LogLine(LOG_INFO) << "WRITE CORRECTIONS IN SIDECAR " << sidecar_file;
+        if (!SidecarSave(sidecar_file, pair.master.size(), pair.corrections, context.sidecar_level)) return false;
+        if (timer.running) timer.record.bytes_written = GetFileSize(sidecar_file);
+        if (context.output_mode == OUTPUT_SIDECAR) return true;
+    }
+    LogLine(LOG_INFO) << "SET VALUES OF HOTPIXELS IN MASTER IMAGE";
+    bool ok;
+    //// Mapped master is read-only: copy the file and set the values in the copy
+    if (pair.master_map && !compress) ok = ImagePatchCopy(pair.master_file, pair.output_file, pair.corrections, context.threads);
+    //// FITS master to FITS output: copy the file and set the values in the copy, keeping the header
+    else if (pair.master_fits && IsFitsFile(pair.output_file)) ok = FitsPatchCopy(pair.master_file, pair.output_file, pair.corrections);
+    else {
+        if (pair.master_map) pair.master = pair.master.clone(); //writable copy of the mapped master
+        BufferSetValues(pair.master, pair.corrections, context.threads);
+        RunsSetValues(pair.master, pair.hotruns, pair.runvalues, context.threads);
+        if (compress) ok = TiffSaveStrips(pair.output_file, pair.master, context.tiff_codec, context.tiff_level, context.tiff_rows_per_strip, context.threads);
+        else ok = ImageSave(pair.output_file, pair.master);
+    }
+    if (timer.running) timer.record.bytes_written += GetFileSize(pair.output_file);
+    return ok;
+}
+
+/************************
+Pipeline stage: hand a corrected frame to the diagnostics renderer, if Diagnostics is set in the config file.
+<pair> has the master buffer and the corrections, its master buffer is emptied and its corrections are handed over if the frame is queued.
+<context> is generated with PipelineInit().
+*************************/
+void PipelineDiagnose(FramePair& pair, const PipelineContext& context) {
+    if (context.diagnostics) context.diagnostics->Submit(pair);
+}
+
+/************************
+***** STREAMING MODE *****
+Correct a pair of TIFF images band by band, so only a band of rows of the master, the slave rows its hot pixels need and the output strip being encoded are in memory at a time.
+StreamingBandRows in the config file sets the number of master rows of a band, 0 decodes whole frames.
+*************************/
+
+/************************
+Rows of an image needed to sample it at some points, with the margin of the interpolation taps.
+<points> are the coordinates where the image is sampled.
+<interpolation> is SAMPLE_NEAREST, SAMPLE_BILINEAR or SAMPLE_BICUBIC.
+<height> is the number of rows of the image.
+<first_row> and <end_row> receive the first needed row and the row after the last one, equal if no row is needed.
+*************************/
+void PointsGetRowFootprint(const std::vector<cv::Point2f>& points, int interpolation, int height, int& first_row, int& end_row) {
+    float low = FLT_MAX, high = -FLT_MAX;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (points[i].y < -0.5f || points[i].y >= height - 0.5f) continue; //outside the image, not sampled
+        low = std::min(low, points[i].y);
+        high = std::max(high, points[i].y);
+    }
+    first_row = end_row = 0;
+    if (low > high) return;
+    int margin = interpolation == SAMPLE_BICUBIC ? 2 : 1;
+    first_row = std::max((int)floor(low) - margin, 0);
+    end_row = std::min((int)floor(high) + margin + 2, height);
+}
+
+/************************
+Correct a pair of TIFF images band by band: read a band of master rows, find its hot pixels, read only the slave rows they map to, sample and adjust them, set them in the band and write it.
+The slave is always sampled sparsely (SparseSlaveSampling=1), a warp of the whole slave would need the whole frame in memory.
+<master> and <slave> are the opened images (see TiffBandReader::Open()).
+<output_file> is the corrected master image.
+<context> is generated with PipelineInit().
+Returns true if execution was correct.
+*************************/
+bool StreamCorrect(TiffBandReader& master, TiffBandReader& slave, std::string output_file, const PipelineContext& context) {
+    StageTimer timer("stream", master.filename);
+    LogLine(LOG_INFO) << "STREAMING CORRECTION IN BANDS OF " << context.stream_rows << " ROWS";
+    TIFF* output = NULL;
+    bool compress = context.tiff_codec != TIFF_WRITE_ENCODER;
+    if (context.output_mode != OUTPUT_SIDECAR) {
+        if (compress) output = TiffOpenStripWriter(output_file, master.width, master.height, context.tiff_codec, context.tiff_rows_per_strip);
+        else output = TiffOpenBandWriter(output_file, master);
+        if (!output) {
+            LogLine(LOG_ERROR) << "Couldn't open " << output_file << " for writing.";
+            return false;
+        }
+    }
+
+    cv::Mat band, slaveband;
+    std::vector<unsigned int> indices;
+    std::vector<int> values;
+    std::vector<Coords> corrections, sidecar; //corrections of the band, and of the frame for the sidecar
+    const unsigned short* lut = &context.brightness_contrast_lut[0];
+    size_t hotcount = 0;
+    bool ok = true;
+    for (int y0 = 0; y0 < master.height && ok; y0 += context.stream_rows) {
+        int y1 = std::min(y0 + context.stream_rows, master.height);
+        if (!master.ReadRows(y0, y1, band)) {
+            ok = false;
+            break;
+        }
+
+        //// Hot pixels of the band, in master raw coordinates
+        BufferGetHotIndices(band, context.threshold, indices, context.threads);
+        std::vector<cv::Point2f> hotpoints = IndicesToPoints(indices, band.cols);
+        for (size_t i = 0; i < hotpoints.size(); i++) hotpoints[i].y += y0;
+        hotcount += hotpoints.size();
+
+        //// Slave rows the hot pixels map to, sampled with the brightness and contrast lookup
+        values.assign(hotpoints.size(), -1);
+        if (!hotpoints.empty()) {
+            std::vector<cv::Point2f> slavepoints = PointsMasterToSlave(hotpoints, context.rig);
+            int sy0, sy1;
+            PointsGetRowFootprint(slavepoints, context.interpolation, slave.height, sy0, sy1);
+            if (sy1 > sy0) {
+                if (!slave.ReadRows(sy0, sy1, slaveband)) {
+                    ok = false;
+                    break;
+                }
+                //// Points outside the slave image stay out of the band buffer
+                for (size_t i = 0; i < slavepoints.size(); i++) {
+                    if (slavepoints[i].y < -0.5f || slavepoints[i].y >= slave.height - 0.5f) slavepoints[i].y = -FLT_MAX;
+                    else slavepoints[i].y -= sy0;
+                }
+                BufferGatherValues(slaveband, slavepoints, context.interpolation, values, lut);
+            }
+        }
+
+        //// Set values in the band and encode its rows
+        corrections.resize(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            corrections[i].x = (int)hotpoints[i].x;
+            corrections[i].y = (int)hotpoints[i].y - y0;
+            corrections[i].v = values[i];
+        }
+        if (context.output_mode != OUTPUT_FRAME) {
+            for (size_t i = 0; i < corrections.size(); i++) {
+                Coords c = { corrections[i].x, corrections[i].y + y0, corrections[i].v };
+                sidecar.push_back(c);
+            }
+        }
+        if (!output) continue;
+        BufferSetValues(band, corrections, context.threads);
+        //// Bands are whole strips when they are compressed here (see PipelineInit())
+        if (compress) ok = TiffWriteStrips(output, band, (uint32_t)(y0 / context.tiff_rows_per_strip), context.tiff_codec, context.tiff_level, context.tiff_rows_per_strip, context.threads);
+        for (int y = 0; y < band.rows && ok && !compress; y++) {
+            if (TIFFWriteScanline(output, band.ptr(y), (uint32_t)(y0 + y), 0) < 0) ok = false;
+        }
+    }
+    if (output) TIFFClose(output);
+    std::string sidecar_file = SidecarFileName(output_file);
+    if (ok && context.output_mode != OUTPUT_FRAME) ok = SidecarSave(sidecar_file, cv::Size(master.width, master.height), sidecar, context.sidecar_level);
 
-    std::cout << std::endl;
+    if (!ok) {
+        LogLine(LOG_ERROR) << "Couldn't stream " << output_file << ".";
+        return false;
+    }
+    if (timer.running) {
+        timer.record.bytes_read = GetFileSize(master.filename) + GetFileSize(slave.filename);
+        timer.record.bytes_written = (context.output_mode != OUTPUT_SIDECAR ? GetFileSize(output_file) : 0) + (context.output_mode != OUTPUT_FRAME ? GetFileSize(sidecar_file) : 0);
+        timer.record.pixels = (unsigned long long)master.width * master.height;
+        timer.record.hot = hotcount;
+    }
+    LogLine(LOG_INFO) << hotcount << " hot pixels corrected. " << (context.output_mode == OUTPUT_SIDECAR ? sidecar_file : output_file) << " written OK!";
     return true;
 }
 
 /************************
-Transform image to rotate and compensate perspective distortion. 
-<image_type> is either "Slave" or "Master". 
-<image_name> image file name to work with. 
-<config_parameters> contains the table of pixel coordinates as text file x y per row (points are top-left x-y, top-right x-y, bottom-left x-y, bottom-right x-y). It is generated with GetConfigFile().
-Returns true if the execution was correct.
+Correct a pair with the pipeline stages and hand it to the diagnostics. With more than one thread master and slave are decoded at the same time and the slave is warped while hot pixels are detected in the master, or correct it band by band when StreamingBandRows is set and both images are 16-bit grayscale TIFF (no quicklook, there is no whole frame in memory).
+<pair> has the input and output file names.
+<context> is generated with PipelineInit().
+Returns true if execution was correct.
 *************************/
-bool RotateAndPerspectiveCorrectionMW(std::string image_type, std::string image_name, std::vector<ConfigParameters> config_parameters) {
-    double persp_points[16];
-    GetPerspectivePointsFromConfig(config_parameters, persp_points, image_type);
+bool PipelineRun(FramePair& pair, PipelineContext& context) {
+    if (context.stream_rows > 0) {
+        TiffBandReader master, slave;
+        if (master.Open(pair.master_file) && slave.Open(pair.slave_file)) return StreamCorrect(master, slave, pair.output_file, context);
+        LogLine(LOG_WARNING) << "Streaming needs 16-bit grayscale TIFF images, decoding whole frames.";
+    }
+    if (!PipelineDecode(pair, context.threads)) return false;
 
-    MagickWand* mw = NULL;
-    MagickWandGenesis();
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
-    if (!MagickReadImage(mw, image_name.c_str())) {
-        std::cerr << std::endl << "Could not open " << image_name << " image... Aborting." << std::endl;
-        exit(0);
+    //// Master branch (hot pixels) and slave branch (warp) of the pair are independent until sampling
+    bool detected = false, prepared = false;
+    if (GetThreadCount(context.threads) > 1) {
+        double slave_cpu_ms = 0;
+        std::thread slave_branch([&]() {
+            prepared = PipelinePrepareSlave(pair, context);
+            slave_cpu_ms = GetThreadCpuMs();
+        });
+        detected = PipelineDetect(pair, context);
+        slave_branch.join();
+        worker_cpu_ms += slave_cpu_ms;
+    }
+    else {
+        detected = PipelineDetect(pair, context);
+        prepared = detected && PipelinePrepareSlave(pair, context);
     }
+    if (!detected || !prepared || !PipelineSample(pair, context) || !PipelineEncode(pair, context)) return false;
+    pair.slaveflat.release();
+    PipelineDiagnose(pair, context);
+    return true;
+}
 
-    //Rotate image
-    double rotation = GetParameterValueFromConfig(config_parameters, image_type + "Rotation");
-    PixelWand* fill = NULL;
-    /* Pixel and drawing wands */
-    fill = NewPixelWand();
-    // Set the fill to "black" for background pixels
-    PixelSetColor(fill, "black");
-    std::cout << "Rotate " << image_type << " image " << rotation << " degrees... " << std::endl;
-    MagickRotateImage(mw, fill, rotation);
-    //Crop image after rotation
-    MagickCropImage(mw, persp_points[14] + 1, persp_points[15] + 1, 0, 0);
-    std::cout << "OK!" << std::endl;
+/************************
+Correct a master/slave pair decoding each input once and writing only the corrected master.
+<mastercam_file> and <slavecam_file> are the input images.
+<output_file> is the corrected master image.
+<config_parameters> is generated with GetConfigFile().
+Returns true if execution was correct.
+*************************/
+bool PipelineCorrect(std::string mastercam_file, std::string slavecam_file, std::string output_file, const std::vector<ConfigParameters>& config_parameters) {
+    PipelineContext context = PipelineInit(config_parameters);
+    FramePair pair;
+    pair.master_file = mastercam_file;
+    pair.slave_file = slavecam_file;
+    pair.output_file = output_file;
 
-    //Distort image to correct for perspective
-    std::cout << "Perspective Correction for " << image_type << " image... " << std::endl;
-    MagickDistortImage(mw, PerspectiveDistortion, 16, (const double*)&persp_points, MagickFalse);
-    std::string dummy = image_type + "Out.tif";
-    MagickWriteImage(mw, dummy.c_str());
-    std::cout << "OK!" << std::endl;
-    //cleaning
-    if (mw)mw = DestroyMagickWand(mw);
+    MagickWandGenesis();
+    bool ok = PipelineRun(pair, context);
     MagickWandTerminus();
+    if (!context.instrumentation_file.empty()) InstrumentationSave(context.instrumentation_file);
+    logger.Flush();
+    return ok;
+}
+
 
+/************************
+***** SERIES MODE *****
+Correct every master/slave pair of a scan inside one process. Decode, hot pixel detection, slave sampling and encode run as stages on their own threads connected by bounded queues, so I/O overlaps compute.
+*************************/
+
+/************************
+Check if a file name matches a pattern with at most one '*' wildcard.
+<name> is the file name.
+<pattern> is the pattern, e.g. "master_*.tif".
+<wildcard> receives the part of the name matched by '*'.
+Returns true if the name matches.
+*************************/
+bool MatchFilePattern(const std::string& name, const std::string& pattern, std::string& wildcard) {
+    size_t star = pattern.find('*');
+    if (star == std::string::npos) {
+        wildcard.clear();
+        return name == pattern;
+    }
+    std::string prefix = pattern.substr(0, star), suffix = pattern.substr(star + 1);
+    if (name.size() < prefix.size() + suffix.size()) return false;
+    if (name.compare(0, prefix.size(), prefix) != 0) return false;
+    if (name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) return false;
+    wildcard = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
     return true;
 }
 
 /************************
-Open image and resize. 
-<filename> is the input file. 
-<width> is the size in percentage for the ouptut image width. 
-<height> is the size in percentage for the output image height.
-Returns true if execution was correct.
+List the files of a directory.
+<directory> is the directory to list.
+Returns the sorted vector of file names.
 *************************/
-bool ResizeImage(std::string filename, std::string outfile, int perc_width, int perc_height) {
-    std::cout << "Resizing image: " << filename << " to " << perc_width << "% width and " << perc_height << "% height... ";
-    MagickWand* mw = NULL;
-    int w, h;
+std::vector<std::string> ListDirectory(std::string directory) {
+    std::vector<std::string> names;
+#ifdef _WIN32 
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) names.push_back(data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+#endif
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/************************
+Pair master and slave images of a series. The part of the master name matched by '*' is used to build the slave name.
+<master_pattern> is the pattern of master images, e.g. "master_*.tif".
+<slave_pattern> is the pattern of slave images, e.g. "slave_*.tif".
+Returns vector of FramePair with the input and output file names, sorted by master name. Corrected images are named Corregida_<master>.
+*************************/
+std::vector<FramePair> ListSeriesPairs(std::string master_pattern, std::string slave_pattern) {
+    std::vector<FramePair> pairs;
+    std::vector<std::string> names = ListDirectory(".");
+    std::string wildcard;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i].compare(0, 10, "Corregida_") == 0) continue;
+        if (!MatchFilePattern(names[i], master_pattern, wildcard)) continue;
+        std::string slave = slave_pattern;
+        size_t star = slave.find('*');
+        if (star != std::string::npos) slave.replace(star, 1, wildcard);
+        if (!std::binary_search(names.begin(), names.end(), slave)) {
+            LogLine(LOG_WARNING) << "No slave image " << slave << " for " << names[i] << ", skipped.";
+            continue;
+        }
+        FramePair pair;
+        pair.master_file = names[i];
+        pair.slave_file = slave;
+        pair.output_file = "Corregida_" + names[i];
+        pairs.push_back(pair);
+    }
+    return pairs;
+}
+
+/************************
+Correct every master/slave pair of a series in one process.
+<master_pattern> and <slave_pattern> select the pairs in the working path (see ListSeriesPairs()).
+<config_parameters> is generated with GetConfigFile(). Threads sets the number of threads (0 for all cores) and SeriesQueueDepth the number of pairs waiting between stages.
+Returns true if all the pairs were corrected.
+*************************/
+bool SeriesCorrect(std::string master_pattern, std::string slave_pattern, const std::vector<ConfigParameters>& config_parameters) {
+    LogLine(LOG_INFO) << "SERIES " << master_pattern << " / " << slave_pattern;
+    std::vector<FramePair> pairs = ListSeriesPairs(master_pattern, slave_pattern);
+    LogLine(LOG_INFO) << pairs.size() << " pairs found.";
+    if (pairs.empty()) return false;
+
+    PipelineContext context = PipelineInit(config_parameters);
+    int threads = GetThreadCount(context.threads);
+    int io_threads = std::max(1, (threads - 2) / 2); //decode and encode threads each, detect and sample have one thread
+    int depth = (int)GetParameterValueFromConfig(config_parameters, "SeriesQueueDepth");
+    if (depth <= 0) depth = 4;
+
+    typedef std::shared_ptr<FramePair> FramePtr;
+    BoundedQueue<FramePtr> detect_queue(depth), sample_queue(depth), encode_queue(depth);
+    std::atomic<size_t> next_pair(0);
+    std::atomic<int> failed(0);
+    size_t detected = 0; //pairs already taken in order by the detector
+    std::mutex order_mutex;
+    std::condition_variable order_changed;
+
     MagickWandGenesis();
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
-    if (!MagickReadImage(mw, filename.c_str())) {
-        std::cerr << std::endl << "Couldn't open " << filename << " original image from SlaveCam... Aborting." << std::endl;
-        exit(0);
+
+    //// Decode: each thread takes the next pair of the list, at most depth pairs ahead of the detector so pairs waiting for an earlier one stay bounded
+    std::vector<std::thread> decoders, encoders;
+    std::atomic<int> decoders_running(io_threads);
+    for (int t = 0; t < io_threads; t++) {
+        decoders.push_back(std::thread([&]() {
+            for (size_t i = next_pair++; i < pairs.size(); i = next_pair++) {
+                {
+                    std::unique_lock<std::mutex> lock(order_mutex);
+                    order_changed.wait(lock, [&] { return i < detected + depth; });
+                }
+                FramePtr pair(new FramePair(pairs[i]));
+                pair->sequence = i;
+                if (!PipelineDecode(*pair)) pair->master.release(); //passed on empty so the detector keeps the order
+                detect_queue.Push(pair);
+            }
+            if (--decoders_running == 0) detect_queue.Close();
+        }));
     }
 
-    // Get the image's width and height
-    w = MagickGetImageWidth(mw);
-    h = MagickGetImageHeight(mw);
-    // Scale image
-    w = w * perc_width / 100;
-    h = h * perc_height / 100;
+    //// Detect hot pixels, in series order (decoders may finish out of order)
+    std::thread detector([&]() {
+        FramePtr pair;
+        std::map<size_t, FramePtr> waiting;
+        size_t next = 0;
+        while (detect_queue.Pop(pair)) {
+            waiting[pair->sequence] = pair;
+            while (!waiting.empty() && waiting.begin()->first == next) {
+                pair = waiting.begin()->second;
+                waiting.erase(waiting.begin());
+                next++;
+                {
+                    std::lock_guard<std::mutex> lock(order_mutex);
+                    detected = next;
+                }
+                order_changed.notify_all();
+                if (!pair->master.empty() && PipelineDetect(*pair, context)) sample_queue.Push(pair);
+                else failed++;
+            }
+        }
+        sample_queue.Close();
+    });
 
-    // Resize the image using the Lanczos filter
-    // The blur factor is a "double", where > 1 is blurry, < 1 is sharp
-    // I haven't figured out how you would change the blur parameter of MagickResizeImage on the command line so I have set it to its default of one.
-    MagickResizeImage(mw, w, h, LanczosFilter, 1);
+    //// Sample the slave, only this thread uses the maps and tables built on first use in the context
+    std::thread sampler([&]() {
+        FramePtr pair;
+        while (sample_queue.Pop(pair)) {
+            bool ok = PipelineSample(*pair, context);
+            pair->slave.release(); //slave buffers are no longer needed once sampled
+            pair->slaveflat.release();
+            pair->slave_map.reset();
+            if (ok) encode_queue.Push(pair);
+            else failed++;
+        }
+        encode_queue.Close();
+    });
 
-    // Write the new image
-    if (MagickWriteImage(mw, outfile.c_str())) std::cout << "Saved scaled imaged as " << outfile << "... DONE." << std::endl;
+    //// Set values and encode
+    for (int t = 0; t < io_threads; t++) {
+        encoders.push_back(std::thread([&]() {
+            FramePtr pair;
+            while (encode_queue.Pop(pair)) {
+                if (!PipelineEncode(*pair, context)) failed++;
+                else PipelineDiagnose(*pair, context);
+                if (!context.instrumentation_file.empty()) InstrumentationFlush(context.instrumentation_file); //records of long series are not kept in memory
+            }
+        }));
+    }
 
-    //clean up
-    if (mw)mw = DestroyMagickWand(mw);
+    for (size_t t = 0; t < decoders.size(); t++) decoders[t].join();
+    detector.join();
+    sampler.join();
+    for (size_t t = 0; t < encoders.size(); t++) encoders[t].join();
     MagickWandTerminus();
-    return true;
+
+    LogLine(LOG_INFO) << "SERIES FINISHED: " << pairs.size() - failed << " of " << pairs.size() << " pairs corrected.";
+    if (!context.instrumentation_file.empty()) InstrumentationSave(context.instrumentation_file);
+    logger.Flush();
+    return failed == 0;
 }
 
 /************************
-Read values of pixels from image and return the reference of the std::vector of class Coords where the coordinates will be stored with the pixel gray value and returned. 
-<filename> corresponding to the image to read values from.
-<points> is the vector of points to read values from.
-Returns vector of coordinates Coords containing x, y and value for each point.
+***** WATCH MODE *****
+Long running process that corrects master/slave pairs while they are being acquired. The config file is read and the transforms are computed once, and only reloaded when the config file changes.
 *************************/
-std::vector<Coords> PointsGetValues(std::string filename, std::vector<cv::Point2i> points) {
-    MagickWand* mw = NULL;
-    MagickWandGenesis();
-    std::vector<Coords> coordinates;
-    Coords dummy_coords;
 
-    /* Create a wand */
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
-    /* Read the input image */
-    std::cout << "Opening file: " << filename << " to get bad pixel values... ";
-    if (!MagickReadImage(mw, filename.c_str())) {
-        std::cerr << std::endl << "Could not open " << filename << " image... Aborting." << std::endl;
-        exit(0);
+//Size and modification time of a file, used to know when a file changed or finished writing
+class FileStamp {
+public:
+    long long size, mtime;
+    bool operator==(const FileStamp& other) const { return size == other.size && mtime == other.mtime; }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+/************************
+Get the size and modification time of a file.
+<filename> is the file.
+<stamp> receives the size and modification time.
+Returns true if the file exists.
+*************************/
+bool GetFileStamp(const std::string& filename, FileStamp& stamp) {
+#ifdef _WIN32 
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data)) return false;
+    stamp.size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    stamp.mtime = ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) return false;
+    stamp.size = (long long)info.st_size;
+    stamp.mtime = (long long)info.st_mtime;
+#endif
+    return true;
+}
+
+//Report the files of a directory that finished writing. Uses inotify on Linux (closed after writing or moved into the directory) and polling elsewhere (size and modification time unchanged between two polls).
+class DirectoryWatcher {
+public:
+    DirectoryWatcher() : fd(-1) {}
+    ~DirectoryWatcher() { Close(); }
+
+    //Start watching a directory. Files already in the directory are not reported.
+    bool Open(const std::string& directory) {
+        Close();
+        this->directory = directory;
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            LogLine(LOG_WARNING) << "Couldn't watch " << directory << " with inotify, polling instead.";
+            Close();
+        }
+#endif
+        std::vector<std::string> names = ListDirectory(directory);
+        reported.clear();
+        reported.insert(names.begin(), names.end());
+        polled.clear();
+        return true;
     }
-    /* Pixel region iterator and pixel wand to get px input info */
-    PixelIterator* iterator = NULL;
-    PixelWand** pixel = NULL;
-    size_t x;
-    int a, b;
 
-    for (int i = 0; i < points.size(); i++) {
-        a = points[i].x; //Point x
-        b = points[i].y; //Point y
-        dummy_coords.x = a;
-        dummy_coords.y = b;
-
-        iterator = NewPixelRegionIterator(mw, a, b, 1, 1);
-        pixel = PixelGetNextIteratorRow(iterator, &x);
-        // save value in coordinates
-        dummy_coords.v = PixelGetRedQuantum(pixel[0]);
-        //std::cout<<i<<" "<<dummy_coords.x<<" "<<dummy_coords.y<<" "<<dummy_coords.v<<std::endl;
-        coordinates.push_back(dummy_coords);
+    //Wait for files up to <timeout_ms> milliseconds. <names> receives the files that finished writing since the last call.
+    void Wait(int timeout_ms, std::vector<std::string>& names) {
+        names.clear();
+#ifdef __linux__
+        if (fd >= 0) {
+            struct pollfd request;
+            request.fd = fd;
+            request.events = POLLIN;
+            request.revents = 0;
+            if (poll(&request, 1, timeout_ms) <= 0) return;
+            char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+                    const struct inotify_event* event = (const struct inotify_event*)p;
+                    if (event->len > 0 && !(event->mask & IN_ISDIR)) names.push_back(event->name);
+                }
+            }
+            return;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        std::vector<std::string> listed = ListDirectory(directory);
+        std::set<std::string> present(listed.begin(), listed.end());
+        for (std::set<std::string>::iterator it = reported.begin(); it != reported.end();) {
+            if (present.count(*it)) ++it;
+            else reported.erase(it++); //deleted, report it again if it is written back
+        }
+        for (size_t i = 0; i < listed.size(); i++) {
+            if (reported.count(listed[i])) continue;
+            FileStamp stamp;
+            if (!GetFileStamp(directory + "/" + listed[i], stamp)) continue;
+            std::map<std::string, FileStamp>::iterator last = polled.find(listed[i]);
+            if (last != polled.end() && last->second == stamp) {
+                names.push_back(listed[i]);
+                reported.insert(listed[i]);
+                polled.erase(last);
+            }
+            else polled[listed[i]] = stamp;
+        }
+    }
+
+    void Close() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+        fd = -1;
     }
-    std::cout << "OK!" << std::endl;
-    /* Tidy up */
-    if (mw) mw = DestroyMagickWand(mw);
-    if (iterator) iterator = DestroyPixelIterator(iterator);
-    MagickWandTerminus();
-    return coordinates;
-}
+
+private:
+    DirectoryWatcher(const DirectoryWatcher&);
+    DirectoryWatcher& operator=(const DirectoryWatcher&);
+
+    std::string directory;
+    int fd; //inotify descriptor, -1 when polling
+    std::set<std::string> reported; //files already reported or there before Open()
+    std::map<std::string, FileStamp> polled; //stamp of the files still being written in the last poll
+};
+
+//Set by SIGINT or SIGTERM to stop watch mode after the pair being corrected
+volatile std::sig_atomic_t watch_stop = 0;
+void WatchStopHandler(int) { watch_stop = 1; }
 
 /************************
-Remove points that have either negative x or y coordinate
-<points> is the input vector of points (it may contain negative points).
-Returns: vector of integer points without negative points.
+Correct master/slave pairs as they are written in the working path, until the process gets SIGINT or SIGTERM.
+Pairs already in the working path without a corrected image are corrected first, masters or slaves already there wait for the other image.
+<master_pattern> and <slave_pattern> select the pairs in the working path (see ListSeriesPairs()).
+<config_file> is the config file, it is read again when it changes.
+<config_parameters> is generated with GetConfigFile(). WatchPollInterval sets the milliseconds between checks of the working path.
+Returns true if all the pairs were corrected.
 *************************/
-std::vector<cv::Point2i> RemoveNegativePoints(std::vector<cv::Point2i> points) {
+bool WatchCorrect(std::string master_pattern, std::string slave_pattern, std::string config_file, std::vector<ConfigParameters> config_parameters) {
+    LogLine(LOG_INFO) << "WATCH " << master_pattern << " / " << slave_pattern << " (Ctrl+C to stop)";
+    PipelineContext context = PipelineInit(config_parameters);
+    FileStamp config_stamp = FileStamp();
+    GetFileStamp(config_file, config_stamp);
+    int poll_ms = (int)GetParameterValueFromConfig(config_parameters, "WatchPollInterval");
+    if (poll_ms <= 0) poll_ms = 200;
 
-    std::vector<cv::Point2i> cleanvector;
-    for (int i = 0; i < points.size(); i++) {
-        if (points[i].x < 0 || points[i].y < 0) {
-            continue;
+    DirectoryWatcher watcher;
+    watcher.Open(".");
+    std::signal(SIGINT, WatchStopHandler);
+    std::signal(SIGTERM, WatchStopHandler);
+    MagickWandGenesis();
+
+    //// Images there before starting to watch are paired first, a master or slave without the other image waits for it
+    std::vector<FramePair> pairs;
+    std::map<std::string, std::string> masters, slaves; //name matched by '*' to file name, waiting for the other image of the pair
+    int corrected = 0, failed = 0;
+    bool startup = true;
+    std::vector<std::string> names = ListDirectory(".");
+
+    while (!watch_stop) {
+        //// Reload config file and transforms only if it changed
+        FileStamp stamp;
+        if (GetFileStamp(config_file, stamp) && stamp != config_stamp) {
+            LogLine(LOG_INFO) << "Config file changed, reloading it.";
+            config_stamp = stamp; //a broken file is reported once, not on every poll
+            std::vector<ConfigParameters> reloaded;
+            std::string missing;
+            if (!ReadConfigFile(config_file, reloaded)) LogLine(LOG_WARNING) << "Couldn't read " << config_file << ", keeping the previous config.";
+            else if (!(missing = ConfigMissingParameter(reloaded)).empty()) LogLine(LOG_WARNING) << config_file << " has no " << missing << ", keeping the previous config.";
+            else {
+                context = PipelineInit(reloaded);
+                config_parameters = reloaded;
+            }
         }
-        else {
-            cleanvector.push_back(points[i]);
+
+        //// Pair new images by the part matched by '*'
+        for (size_t i = 0; i < names.size(); i++) {
+            std::string wildcard;
+            if (names[i].compare(0, 10, "Corregida_") == 0) continue;
+            if (MatchFilePattern(names[i], master_pattern, wildcard)) masters[wildcard] = names[i];
+            else if (MatchFilePattern(names[i], slave_pattern, wildcard)) slaves[wildcard] = names[i];
+            else continue;
+            if (masters.count(wildcard) && slaves.count(wildcard)) {
+                FramePair pair;
+                pair.master_file = masters[wildcard];
+                pair.slave_file = slaves[wildcard];
+                pair.output_file = "Corregida_" + pair.master_file;
+                pairs.push_back(pair);
+                masters.erase(wildcard);
+                slaves.erase(wildcard);
+            }
         }
-    }
 
+        //// Correct the pairs with the context already initialized
+        for (size_t i = 0; i < pairs.size() && !watch_stop; i++) {
+            FileStamp output;
+            if (startup && GetFileStamp(context.output_mode == OUTPUT_SIDECAR ? SidecarFileName(pairs[i].output_file) : pairs[i].output_file, output)) continue; //corrected before starting to watch
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool ok = PipelineRun(pairs[i], context);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (ok) {
+                corrected++;
+                LogLine(LOG_INFO) << "Corrected " << pairs[i].output_file << " in " << ms << " ms.";
+            }
+            else {
+                failed++;
+                LogLine(LOG_ERROR) << "Couldn't correct " << pairs[i].master_file << " with " << pairs[i].slave_file << ".";
+            }
+            if (!context.instrumentation_file.empty()) InstrumentationFlush(context.instrumentation_file); //the records can be read while watching
+        }
+        pairs.clear();
+        startup = false;
+
+        watcher.Wait(poll_ms, names);
+    }
 
-    return cleanvector;
+    MagickWandTerminus();
+    LogLine(LOG_INFO) << "WATCH FINISHED: " << corrected << " pairs corrected, " << failed << " failed.";
+    if (!context.instrumentation_file.empty()) InstrumentationSave(context.instrumentation_file);
+    logger.Flush();
+    return failed == 0;
 }
 
 /************************
-Set values of pixels in image.
-<infilename> corresponding to input image.
-<outfilename> corresponds to output image.
-<coordinates> has x, y and gray value to set and save in the output image.
+***** DEFECT MAP *****
+Build the map of the permanently hot pixels of the master sensor from a calibration run (dark frames), so the frames of the experiment do not need to find them again.
+*************************/
+
+/************************
+Build a defect map from calibration frames: a pixel is a defect if it is equal or above MasterThresholdHotPixels in at least DefectFrameFraction of the frames.
+<calibration_pattern> selects the calibration frames in the working path with one '*' wildcard, e.g. dark_*.tif.
+<config_parameters> is generated with GetConfigFile(). The map is written to DefectMapFile (DefectMap.bin if not set), as a text list of x y coordinates if it ends in .txt.
 Returns true if execution was correct.
 *************************/
-/* Set values of pixels of image .*/
-bool SetValues(std::string infilename, std::string outfilename, std::vector<Coords>& coordinates) {
-    std::cout << "Setting pixel gray values in file: " << infilename << "... ";
-    MagickWand* mw = NULL;
-    DrawingWand* dw = NULL;
-    PixelWand* fill = NULL;
+bool DefectMapBuild(std::string calibration_pattern, const std::vector<ConfigParameters>& config_parameters) {
+    LogLine(LOG_INFO) << "DEFECT MAP FROM " << calibration_pattern;
+    std::string output_file = GetTextFromConfig(config_parameters, "DefectMapFile");
+    if (output_file.empty()) output_file = "DefectMap.bin";
+    long threshold = (long)GetParameterValueFromConfig(config_parameters, "MasterThresholdHotPixels");
+    double fraction = GetParameterValueFromConfig(config_parameters, "DefectFrameFraction");
+    if (fraction <= 0 || fraction > 1) fraction = 0.5;
+    int threads = (int)GetParameterValueFromConfig(config_parameters, "Threads");
+
+    //// Count how many frames each pixel is hot in
+    std::vector<std::string> names = ListDirectory(".");
+    std::vector<unsigned short> counts;
+    std::vector<unsigned int> indices;
+    cv::Size size;
+    int frames = 0;
+    std::string wildcard;
     MagickWandGenesis();
-    /* Create a wand */
-    mw = NewMagickWand();
-    MagickSetType(mw, GrayscaleType);
-    /* Read the input image */
-    if (!MagickReadImage(mw, infilename.c_str())) {
-        std::cerr << std::endl << "Could not open " << infilename << " image... Aborting." << std::endl;
-        exit(0);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i].compare(0, 10, "Corregida_") == 0 || !MatchFilePattern(names[i], calibration_pattern, wildcard)) continue;
+        cv::Mat image;
+        std::shared_ptr<MappedFile> map;
+        if (!ImageMap(names[i], image, map) && !FitsLoad(names[i], image) && !ImageLoad(names[i], image)) continue;
+        if (frames == 0) {
+            size = image.size();
+            counts.assign((size_t)size.area(), 0);
+        }
+        else if (image.size() != size) {
+            LogLine(LOG_WARNING) << names[i] << " has a different size, skipped.";
+            continue;
+        }
+        BufferGetHotIndices(image, threshold, indices, threads);
+        for (size_t k = 0; k < indices.size(); k++) {
+            if (counts[indices[k]] < USHRT_MAX) counts[indices[k]]++;
+        }
+        frames++;
+    }
+    MagickWandTerminus();
+    if (frames == 0) {
+        LogLine(LOG_ERROR) << "No calibration frames " << calibration_pattern << " found.";
+        return false;
     }
 
-    /* Pixel and drawing wands */
-    fill = NewPixelWand();
-    dw = NewDrawingWand();
-    // Set the fill to "red" or you can do the same thing with this:
-    // PixelSetColor(fill,"rgb(255,0,0)") or PixelSetColor(fill,"red");
-    //PixelSetColor(fill,"rgb(100,101,100)");
-
-    /* Pixel region iterator and pixel wand to get px input info */
-    PixelIterator* iterator = NULL;
-    PixelWand** pixel = NULL;
-    size_t x;
-
-    /*//Add this to list pixels and values in image corresponding to coordinates
-    for(int i=0;i<coordinates.size();i++){
-      iterator = NewPixelRegionIterator(mw,coordinates[i].x,coordinates[i].y,1,1);
-      pixel=PixelGetNextIteratorRow(iterator,&x);
-      std::cout<<i<<" "<<coordinates[i].x<<" "<<coordinates[i].y<<" "<<PixelGetRedQuantum(pixel[0])<<" "<<PixelGetGreenQuantum(pixel[0])<<" "<<PixelGetBlueQuantum(pixel[0])<<std::endl;
-    }
-    */
-
-    Quantum q; //value to set in pixel
-    int a, b;
-    for (int i = 0; i < coordinates.size(); i++) {
-        q = coordinates[i].v;
-        PixelSetRedQuantum(fill, q);
-        PixelSetGreenQuantum(fill, q);
-        PixelSetBlueQuantum(fill, q);
-        DrawSetFillColor(dw, fill);
-        // Uses the current Fill as the colour of the point in coordinates
-        DrawPoint(dw, coordinates[i].x, coordinates[i].y);
-    }
-    MagickDrawImage(mw, dw);
-    /* write it */
-    if (MagickWriteImage(mw, outfilename.c_str())) {
-        std::cout << "wrote final file in " << outfilename << "... DONE." << std::endl;
+    //// Pixels hot in enough frames
+    unsigned int min_count = (unsigned int)std::max(1.0, ceil(fraction * frames));
+    indices.clear();
+    for (size_t k = 0; k < counts.size(); k++) {
+        if (counts[k] >= min_count) indices.push_back((unsigned int)k);
     }
-    else {
-        std::cerr << "Couldn't write output file " << outfilename << "... ABORTING." << std::endl;
-        exit(0);
+    LogLine(LOG_INFO) << indices.size() << " defects hot in at least " << min_count << " of " << frames << " frames.";
+
+    size_t dot = output_file.find_last_of('.');
+    if (dot != std::string::npos && output_file.substr(dot) == ".txt") {
+        std::ofstream file(output_file.c_str());
+        file << "# x y of the defects of the master sensor" << std::endl;
+        for (size_t k = 0; k < indices.size(); k++) file << indices[k] % size.width << " " << indices[k] / size.width << std::endl;
+        file.close();
+        if (!file) {
+            LogLine(LOG_ERROR) << "Couldn't write defect map " << output_file << ".";
+            return false;
+        }
     }
+    else if (!DefectMapSave(output_file, size, indices)) return false;
 
-    /*//Add this to list pixels and values in image corresponding to coordinates
-    for(int i=0;i<coordinates.size();i++){
-      iterator = NewPixelRegionIterator(mw,coordinates[i].x,coordinates[i].y,1,1);
-      pixel=PixelGetNextIteratorRow(iterator,&x);
-      std::cout<<i<<" "<<coordinates[i].x<<" "<<coordinates[i].y<<" "<<PixelGetRedQuantum(pixel[0])<<" "<<PixelGetGreenQuantum(pixel[0])<<" "<<PixelGetBlueQuantum(pixel[0])<<std::endl;
+    //// The map is read back as PipelineInit() will read it
+    DefectMap check;
+    DefectMapLoad(output_file, check);
+    bool same = check.points.size() == indices.size();
+    for (size_t k = 0; k < indices.size() && same; k++) same = check.points[k].x == (float)(indices[k] % size.width) && check.points[k].y == (float)(indices[k] / size.width);
+    if (!same) {
+        LogLine(LOG_ERROR) << "Defect map " << output_file << " does not read back as written.";
+        return false;
     }
-    */
+    LogLine(LOG_INFO) << "Defect map written in " << output_file << "... DONE.";
+    return true;
+}
 
+/************************
+***** CORRECTION SIDECARS *****
+With OutputMode=1 the raw master is kept and only its corrections are written, in a sidecar. The corrected frame is rebuilt when it is needed.
+*************************/
 
-    /* Tidy up */
-    if (dw)dw = DestroyDrawingWand(dw);
-    if (fill)fill = DestroyPixelWand(fill);
-    if (mw) mw = DestroyMagickWand(mw);
-    MagickWandTerminus();
+/************************
+Rebuild a corrected frame from the raw master and its sidecar.
+<master_file> is the raw master image.
+<sidecar_file> is its sidecar (see SidecarSave()).
+<image> receives the corrected CV_16UC1 buffer.
+<threads> is the number of threads used to decode and correct, 0 for all the cores.
+Returns true if execution was correct.
+*************************/
+bool SidecarApply(std::string master_file, std::string sidecar_file, cv::Mat& image, int threads = 1) {
+    cv::Size size;
+    std::vector<Coords> corrections;
+    if (!SidecarLoad(sidecar_file, size, corrections)) return false;
+    if (!FitsLoad(master_file, image, threads) && !ImageLoad(master_file, image)) return false;
+    if (image.size() != size) {
+        LogLine(LOG_ERROR) << "Sidecar " << sidecar_file << " is for " << size.width << "x" << size.height << " frames, " << master_file << " is " << image.cols << "x" << image.rows << ".";
+        return false;
+    }
+    BufferSetValues(image, corrections, threads);
     return true;
 }
+
+/************************
+Write the corrected image of a raw master and its sidecar, with the name the full output would have had: the sidecar name with the extension of the master. A FITS master keeps its header and extensions, a TIFF is compressed as set by OutputCompression.
+<master_file> is the raw master image.
+<sidecar_file> is its sidecar (see SidecarSave()).
+<config_parameters> is generated with GetConfigFile().
+Returns true if execution was correct.
+*************************/
+bool SidecarWrite(std::string master_file, std::string sidecar_file, const std::vector<ConfigParameters>& config_parameters) {
+    int threads = (int)GetParameterValueFromConfig(config_parameters, "Threads");
+    size_t dot = master_file.find_last_of('.'), sidecar_dot = sidecar_file.find_last_of('.');
+    std::string output_file = sidecar_file.substr(0, sidecar_dot) + (dot == std::string::npos ? ".tif" : master_file.substr(dot));
+    LogLine(LOG_INFO) << "APPLY SIDECAR " << sidecar_file << " TO " << master_file;
+
+    MagickWandGenesis();
+    bool ok;
+    cv::Mat image;
+    if (IsFitsFile(master_file) && FitsLoad(master_file, image, threads)) {
+        cv::Size size;
+        std::vector<Coords> corrections;
+        ok = SidecarLoad(sidecar_file, size, corrections) && size == image.size() && FitsPatchCopy(master_file, output_file, corrections);
+    }
+    else if (SidecarApply(master_file, sidecar_file, image, threads)) {
+        int codec = std::min(std::max((int)GetParameterValueFromConfig(config_parameters, "OutputCompression"), TIFF_WRITE_ENCODER), TIFF_WRITE_ZSTD);
+        int rows_per_strip = (int)GetParameterValueFromConfig(config_parameters, "OutputRowsPerStrip");
+        if (codec != TIFF_WRITE_ENCODER && IsTiffFile(output_file)) ok = TiffSaveStrips(output_file, image, codec, (int)GetParameterValueFromConfig(config_parameters, "OutputCompressionLevel"), rows_per_strip > 0 ? rows_per_strip : 64, threads);
+        else ok = ImageSave(output_file, image);
+    }
+    else ok = false;
+    MagickWandTerminus();
+    if (!ok) LogLine(LOG_ERROR) << "Couldn't apply " << sidecar_file << " to " << master_file << ".";
+    else LogLine(LOG_INFO) << output_file << " written OK!";
+    logger.Flush();
+    return ok;
+}
+
+#ifdef MULTI_CAM_LIBRARY
+}
+#endif
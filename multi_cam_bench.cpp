@@ -0,0 +1,200 @@
+/*
+- Benchmark of the stages of multi_cam on synthetic detector frames.
+- Builds master/slave pairs at the sensor size with hot pixels and gamma streaks, the slave warped from the master scene by the homographies of the rig, and times every stage separately.
+- Usage: ./multi_cam_bench [frames] [hot_pixel_density] [streaks] [threads]
+<frames> is the number of synthetic pairs (default 10).
+<hot_pixel_density> is the fraction of master pixels that are hot (default 0.001).
+<streaks> is the number of gamma streaks per frame (default 200).
+<threads> is the number of threads of the parallel kernels, 0 for all the cores (default 0).
+*/
+
+
+#include "multi_cam.h"
+#include <random>
+#include <iomanip>
+
+
+//Size of the sensor of the detector cameras
+const int BENCH_WIDTH = 4656;
+const int BENCH_HEIGHT = 3520;
+
+//Class to store the times of a stage, one per frame
+class StageTimes {
+public:
+    std::string name; //name of the stage
+    std::vector<double> ms; //time of every frame in milliseconds
+    double pixels; //pixels processed per frame, for the throughput
+};
+
+/************************
+Build the config parameters of the rig used for the synthetic frames, the registration points of config_example.cfg.
+Returns vector of ConfigParameters as read by GetConfigFile().
+*************************/
+std::vector<ConfigParameters> BenchConfig() {
+    const char* names[] = {
+        "MasterSourceTopLeftX", "MasterSourceTopLeftY", "MasterDestTopLeftX", "MasterDestTopLeftY",
+        "MasterSourceTopRightX", "MasterSourceTopRightY", "MasterDestTopRightX", "MasterDestTopRightY",
+        "MasterSourceBottomLeftX", "MasterSourceBottomLeftY", "MasterDestBottomLeftX", "MasterDestBottomLeftY",
+        "MasterSourceBottomRightX", "MasterSourceBottomRightY", "MasterDestBottomRightX", "MasterDestBottomRightY",
+        "MasterRotation", "MasterThresholdHotPixels",
+        "SlaveSourceTopLeftX", "SlaveSourceTopLeftY", "SlaveDestTopLeftX", "SlaveDestTopLeftY",
+        "SlaveSourceTopRightX", "SlaveSourceTopRightY", "SlaveDestTopRightX", "SlaveDestTopRightY",
+        "SlaveSourceBottomLeftX", "SlaveSourceBottomLeftY", "SlaveDestBottomLeftX", "SlaveDestBottomLeftY",
+        "SlaveSourceBottomRightX", "SlaveSourceBottomRightY", "SlaveDestBottomRightX", "SlaveDestBottomRightY",
+        "SlaveRotation", "SlaveBrightness", "SlaveContrast", "MasterThresholdLow" };
+    const double values[] = {
+        165, 7, 0, 0, 4542, 7, 4655, 0, 162, 3381, 0, 3519, 4535, 3378, 4655, 3519, 0.9, 55000,
+        15, 89, 0, 0, 4246, 138, 4655, 0, 9, 3457, 0, 3519, 4236, 3407, 4655, 3519, -0.7, -10, -10, 40000 };
+    std::vector<ConfigParameters> config_parameters;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        ConfigParameters parameter;
+        parameter.parameter = names[i];
+        parameter.value = values[i];
+        config_parameters.push_back(parameter);
+    }
+    return config_parameters;
+}
+
+/************************
+Generate a synthetic master/slave pair.
+<rig> has the matrices of the rig, the slave is the scene seen through master_to_slave.
+<density> is the fraction of master pixels that are hot.
+<streaks> is the number of gamma streaks in the master.
+<random> is the random generator.
+<master> and <slave> receive the CV_16UC1 frames.
+*************************/
+void BenchGeneratePair(const RigTransforms& rig, double density, int streaks, std::mt19937& random, cv::Mat& master, cv::Mat& slave) {
+    //// Scene: smooth sample features and noise
+    cv::Mat scene(BENCH_HEIGHT, BENCH_WIDTH, CV_16UC1);
+    std::normal_distribution<float> noise(0.0f, 30.0f);
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        unsigned short* row = scene.ptr<unsigned short>(y);
+        for (int x = 0; x < BENCH_WIDTH; x++) {
+            float v = 20000.0f + 8000.0f * sin(x * 0.004f) * cos(y * 0.003f) + noise(random);
+            row[x] = (unsigned short)std::min(std::max(v, 0.0f), 65535.0f);
+        }
+    }
+    master = scene.clone();
+    cv::warpPerspective(scene, slave, rig.master_to_slave, scene.size());
+
+    //// Isolated hot pixels
+    std::uniform_int_distribution<int> column(0, BENCH_WIDTH - 1), row(0, BENCH_HEIGHT - 1), level(55000, 65535);
+    size_t hot = (size_t)(density * BENCH_WIDTH * BENCH_HEIGHT);
+    for (size_t i = 0; i < hot; i++) master.at<unsigned short>(row(random), column(random)) = (unsigned short)level(random);
+
+    //// Gamma streaks: short bright segments with a dimmer halo
+    std::uniform_real_distribution<float> angle(0.0f, (float)CV_PI), length(5.0f, 40.0f);
+    for (int s = 0; s < streaks; s++) {
+        float x0 = (float)column(random), y0 = (float)row(random), a = angle(random), l = length(random);
+        for (float t = 0; t < l; t += 0.5f) {
+            int x = (int)(x0 + t * cos(a)), y = (int)(y0 + t * sin(a));
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (x + dx < 0 || y + dy < 0 || x + dx >= BENCH_WIDTH || y + dy >= BENCH_HEIGHT) continue;
+                    unsigned short& p = master.at<unsigned short>(y + dy, x + dx);
+                    p = std::max(p, (unsigned short)(dx == 0 && dy == 0 ? 65535 : 45000));
+                }
+            }
+        }
+    }
+}
+
+/************************
+Percentile of a list of times.
+<ms> are the times, sorted.
+<p> is the percentile, 0-1.
+Returns the time at the percentile.
+*************************/
+double BenchPercentile(const std::vector<double>& ms, double p) {
+    if (ms.empty()) return 0;
+    size_t i = (size_t)std::max(0.0, ceil(p * ms.size()) - 1);
+    return ms[std::min(i, ms.size() - 1)];
+}
+
+/************************
+Run a stage and add its time to the stage times.
+<times> receives the time in milliseconds.
+<stage> is the code of the stage.
+*************************/
+void BenchTime(StageTimes& times, const std::function<void()>& stage) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    stage();
+    times.ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+/*************************
+***** MAIN FUNCTION  *****
+*************************/
+
+int main(int argc, const char** argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 10;
+    double density = argc > 2 ? atof(argv[2]) : 0.001;
+    int streaks = argc > 3 ? atoi(argv[3]) : 200;
+    int threads = argc > 4 ? atoi(argv[4]) : 0;
+    if (frames <= 0) frames = 1;
+    std::cout << "BENCHMARK " << frames << " frames " << BENCH_WIDTH << "x" << BENCH_HEIGHT << ", hot pixel density " << density << ", " << streaks << " streaks, " << GetThreadCount(threads) << " threads" << std::endl;
+
+    std::vector<ConfigParameters> config_parameters = BenchConfig();
+    PipelineContext context = PipelineInit(config_parameters);
+    context.threads = threads;
+    double frame_pixels = (double)BENCH_WIDTH * BENCH_HEIGHT;
+    BuildRemapTables(context.rig.slave, cv::Size(BENCH_WIDTH, BENCH_HEIGHT), context.slave_maps, threads);
+
+    const char* names[] = { "detect pixels", "detect adaptive", "detect streaks", "point transform", "full warp", "gather", "brightness/contrast", "scatter", "encode", "encode deflate" };
+    const int stages = sizeof(names) / sizeof(names[0]);
+    std::vector<StageTimes> times(stages);
+    for (int s = 0; s < stages; s++) {
+        times[s].name = names[s];
+        times[s].pixels = frame_pixels;
+    }
+
+    std::mt19937 random(12345);
+    MagickWandGenesis();
+    logger.Configure(LOG_WARNING, ""); //stages log their progress, keep it out of the report
+    for (int f = 0; f < frames; f++) {
+        cv::Mat master, slave, slaveflat;
+        BenchGeneratePair(context.rig, density, streaks, random, master, slave);
+        std::vector<unsigned int> indices, adaptive;
+        long threshold;
+        std::vector<PixelRun> runs;
+        std::vector<cv::Point2f> hotpoints, slavepoints;
+        std::vector<int> values;
+        std::vector<Coords> corrections;
+
+        BenchTime(times[0], [&]() { BufferGetHotIndices(master, context.threshold, indices, threads); });
+        BenchTime(times[1], [&]() { BufferGetAdaptiveHotIndices(master, THRESHOLD_PERCENTILE, 99.9, context.threshold_low, context.threshold, adaptive, threshold, threads); });
+        BenchTime(times[2], [&]() { BufferGetHotRuns(master, context.threshold_low, context.threshold, 0, runs); });
+        hotpoints = IndicesToPoints(indices, master.cols);
+        BenchTime(times[3], [&]() { slavepoints = PointsMasterToSlave(hotpoints, context.rig); });
+        BenchTime(times[4], [&]() { BufferRemap(slave, slaveflat, context.slave_maps, threads); });
+        BenchTime(times[5], [&]() { BufferGatherValues(slave, slavepoints, context.interpolation, values, &context.brightness_contrast_lut[0]); });
+        BenchTime(times[6], [&]() { BufferApplyLut(slaveflat, context.brightness_contrast_lut, threads); });
+        corrections.resize(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            Coords c = { (int)hotpoints[i].x, (int)hotpoints[i].y, values[i] };
+            corrections[i] = c;
+        }
+        BenchTime(times[7], [&]() { BufferSetValues(master, corrections, threads); });
+        BenchTime(times[8], [&]() { ImageSave("BenchCorregida.tif", master); });
+        BenchTime(times[9], [&]() { TiffSaveStrips("BenchCorregidaDeflate.tif", master, TIFF_WRITE_DEFLATE, 1, 64, threads); });
+
+        times[3].pixels = times[5].pixels = times[7].pixels = (double)hotpoints.size(); //sparse stages work on the hot pixels only
+        std::cout << "frame " << f + 1 << ": " << hotpoints.size() << " hot pixels, " << runs.size() << " streak runs, encoded " << GetFileSize("BenchCorregida.tif") / 1024 << " KB, deflate " << GetFileSize("BenchCorregidaDeflate.tif") / 1024 << " KB" << std::endl;
+    }
+    MagickWandTerminus();
+    remove("BenchCorregida.tif");
+    remove("BenchCorregidaDeflate.tif");
+
+    //// Report
+    std::cout << std::endl << std::left << std::setw(22) << "stage" << std::right << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms" << std::setw(12) << "Mpix/s" << std::endl;
+    for (int s = 0; s < stages; s++) {
+        std::sort(times[s].ms.begin(), times[s].ms.end());
+        double p50 = BenchPercentile(times[s].ms, 0.5);
+        std::cout << std::left << std::setw(22) << times[s].name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << p50 << std::setw(10) << BenchPercentile(times[s].ms, 0.9) << std::setw(10) << BenchPercentile(times[s].ms, 0.99)
+                  << std::setw(12) << (p50 > 0 ? times[s].pixels / (p50 * 1000.0) : 0.0) << std::endl;
+    }
+    std::cout << "Mpix/s of point transform, gather and scatter count hot pixels, the other stages count frame pixels." << std::endl;
+    return 0;
+}
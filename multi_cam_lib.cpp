@@ -0,0 +1,228 @@
+/*
+- Library implementation of multi_cam_lib.h on top of the kernels of multi_cam.h.
+- Frames are corrected row by row: hot pixels of the row, their slave raw coordinates, slave values with the brightness and contrast table, and the values set in the output row. All the buffers of a row are sized once by Corrector::Init() for the widest row, so Correct() does not allocate.
+*/
+
+
+#define MULTI_CAM_LIBRARY //internals of multi_cam.h are not exported
+#include "multi_cam.h"
+#include "multi_cam_lib.h"
+
+
+//Names of the registration corners in the config file, in the order of RigQuad
+static const char* RIG_CORNERS[4] = { "TopLeft", "TopRight", "BottomLeft", "BottomRight" };
+
+RigQuad::RigQuad() : rotation(0) {
+    for (int i = 0; i < 4; i++) source_x[i] = source_y[i] = dest_x[i] = dest_y[i] = 0;
+}
+
+RigConfig::RigConfig() : master_width(0), master_height(0), slave_width(0), slave_height(0), threshold(55000), brightness(0), contrast(0), interpolation(SAMPLE_BILINEAR) {}
+
+//Class to store what Corrector::Init() builds once for a rig
+class CorrectorState {
+public:
+    RigConfig config; //validated config of the rig
+    double master_to_slave[9]; //master raw -> slave raw matrix, row major
+    std::vector<unsigned short> lut; //transfer function of brightness and contrast, see BuildBrightnessContrastLut()
+    std::vector<unsigned int> indices; //hot pixels of a row, capacity of a master row
+    std::vector<cv::Point2f> points; //slave raw coordinates of the hot pixels of a row, same capacity
+    std::vector<int> values; //slave values of the hot pixels of a row, same capacity
+    size_t hot, corrected; //hot pixels found and replaced by the last Correct()
+
+    CorrectorState() : hot(0), corrected(0) {}
+};
+
+/************************
+Build the config parameters of the rig, with the names of the config file, so the matrices are computed as in the multi_cam command.
+<config> is the typed config.
+Returns vector of ConfigParameters as read by GetConfigFile().
+*************************/
+static std::vector<ConfigParameters> RigConfigToParameters(const RigConfig& config) {
+    std::vector<ConfigParameters> config_parameters;
+    const char* images[2] = { "Master", "Slave" };
+    for (int image = 0; image < 2; image++) {
+        const RigQuad& quad = image == 0 ? config.master : config.slave;
+        for (int corner = 0; corner < 4; corner++) {
+            const float values[4] = { quad.source_x[corner], quad.source_y[corner], quad.dest_x[corner], quad.dest_y[corner] };
+            const char* points[4] = { "Source", "Source", "Dest", "Dest" };
+            const char* axes[4] = { "X", "Y", "X", "Y" };
+            for (int k = 0; k < 4; k++) {
+                ConfigParameters parameter;
+                parameter.parameter = std::string(images[image]) + points[k] + RIG_CORNERS[corner] + axes[k];
+                parameter.value = values[k];
+                config_parameters.push_back(parameter);
+            }
+        }
+        ConfigParameters rotation;
+        rotation.parameter = std::string(images[image]) + "Rotation";
+        rotation.value = quad.rotation;
+        config_parameters.push_back(rotation);
+    }
+    return config_parameters;
+}
+
+/************************
+Determinant of a 3x3 CV_64F matrix.
+*************************/
+static double MatrixDeterminant(const cv::Mat& m) {
+    return m.at<double>(0, 0) * (m.at<double>(1, 1) * m.at<double>(2, 2) - m.at<double>(1, 2) * m.at<double>(2, 1))
+         - m.at<double>(0, 1) * (m.at<double>(1, 0) * m.at<double>(2, 2) - m.at<double>(1, 2) * m.at<double>(2, 0))
+         + m.at<double>(0, 2) * (m.at<double>(1, 0) * m.at<double>(2, 1) - m.at<double>(1, 1) * m.at<double>(2, 0));
+}
+
+/************************
+Check a view against the frame size of the config.
+Returns true if the view has a buffer, the expected size and a step of at least a row.
+*************************/
+static bool ViewIsValid(const void* data, int width, int height, size_t step, int expected_width, int expected_height) {
+    return data != NULL && width == expected_width && height == expected_height && (step == 0 || step >= (size_t)width * sizeof(unsigned short));
+}
+
+int RigConfigLoad(std::string filename, RigConfig& config) {
+    std::vector<ConfigParameters> config_parameters;
+    if (!ReadConfigFile(filename, config_parameters)) return CORRECT_FILE_ERROR;
+    std::set<std::string> names;
+    for (size_t i = 0; i < config_parameters.size(); i++) names.insert(config_parameters[i].parameter);
+
+    const char* images[2] = { "Master", "Slave" };
+    for (int image = 0; image < 2; image++) {
+        RigQuad& quad = image == 0 ? config.master : config.slave;
+        std::string prefix = images[image];
+        for (int corner = 0; corner < 4; corner++) {
+            std::string source = prefix + "Source" + RIG_CORNERS[corner], dest = prefix + "Dest" + RIG_CORNERS[corner];
+            if (!names.count(source + "X") || !names.count(source + "Y") || !names.count(dest + "X") || !names.count(dest + "Y")) return CORRECT_INVALID_CONFIG;
+            quad.source_x[corner] = (float)GetParameterValueFromConfig(config_parameters, source + "X");
+            quad.source_y[corner] = (float)GetParameterValueFromConfig(config_parameters, source + "Y");
+            quad.dest_x[corner] = (float)GetParameterValueFromConfig(config_parameters, dest + "X");
+            quad.dest_y[corner] = (float)GetParameterValueFromConfig(config_parameters, dest + "Y");
+        }
+        quad.rotation = GetParameterValueFromConfig(config_parameters, prefix + "Rotation");
+    }
+    if (!names.count("MasterThresholdHotPixels")) return CORRECT_INVALID_CONFIG;
+    config.threshold = (long)GetParameterValueFromConfig(config_parameters, "MasterThresholdHotPixels");
+    //// Optional keys, the fields keep their values (RigConfig() defaults) when they are not in the file
+    if (names.count("SlaveBrightness")) config.brightness = GetParameterValueFromConfig(config_parameters, "SlaveBrightness");
+    if (names.count("SlaveContrast")) config.contrast = GetParameterValueFromConfig(config_parameters, "SlaveContrast");
+    if (names.count("SlaveInterpolation")) config.interpolation = (int)GetParameterValueFromConfig(config_parameters, "SlaveInterpolation");
+    return CORRECT_OK;
+}
+
+int RigConfigValidate(const RigConfig& config) {
+    if (config.master_width <= 0 || config.master_height <= 0 || config.slave_width <= 0 || config.slave_height <= 0) return CORRECT_INVALID_CONFIG;
+    if ((unsigned long long)config.master_width * config.master_height > 0xFFFFFFFFull) return CORRECT_INVALID_CONFIG; //raster indices are 32-bit
+    if (config.threshold < 0 || config.threshold > 65535) return CORRECT_INVALID_CONFIG;
+    if (!(fabs(config.brightness) <= 100) || !(fabs(config.contrast) <= 100)) return CORRECT_INVALID_CONFIG;
+    if (config.interpolation < SAMPLE_NEAREST || config.interpolation > SAMPLE_BICUBIC) return CORRECT_INVALID_CONFIG;
+    const RigQuad* quads[2] = { &config.master, &config.slave };
+    for (int q = 0; q < 2; q++) {
+        if (!std::isfinite(quads[q]->rotation)) return CORRECT_INVALID_CONFIG;
+        for (int i = 0; i < 4; i++) {
+            if (!std::isfinite(quads[q]->source_x[i]) || !std::isfinite(quads[q]->source_y[i]) || !std::isfinite(quads[q]->dest_x[i]) || !std::isfinite(quads[q]->dest_y[i])) return CORRECT_INVALID_CONFIG;
+        }
+    }
+    //// Collinear or repeated registration points give singular transforms
+    RigTransforms rig = GetRigTransforms(RigConfigToParameters(config));
+    double master_det = MatrixDeterminant(rig.master), slave_det = MatrixDeterminant(rig.slave);
+    if (!std::isfinite(master_det) || !std::isfinite(slave_det) || fabs(master_det) < 1e-12 || fabs(slave_det) < 1e-12) return CORRECT_INVALID_CONFIG;
+    return CORRECT_OK;
+}
+
+const char* CorrectStatusText(int status) {
+    switch (status) {
+    case CORRECT_OK: return "OK";
+    case CORRECT_FILE_ERROR: return "config file could not be read";
+    case CORRECT_INVALID_CONFIG: return "invalid rig config";
+    case CORRECT_NOT_INITIALIZED: return "corrector not initialized";
+    case CORRECT_INVALID_VIEW: return "invalid image view";
+    default: return "unknown status";
+    }
+}
+
+int SidecarApplyToView(std::string filename, const OutputView& frame) {
+    cv::Size size;
+    std::vector<Coords> corrections;
+    if (!SidecarLoad(filename, size, corrections)) return CORRECT_FILE_ERROR;
+    if (!ViewIsValid(frame.data, frame.width, frame.height, frame.step, size.width, size.height)) return CORRECT_INVALID_VIEW;
+    size_t step = frame.step ? frame.step : (size_t)frame.width * sizeof(unsigned short);
+    for (size_t i = 0; i < corrections.size(); i++) {
+        ((unsigned short*)((unsigned char*)frame.data + corrections[i].y * step))[corrections[i].x] = (unsigned short)corrections[i].v;
+    }
+    return CORRECT_OK;
+}
+
+Corrector::Corrector() : state(NULL) {}
+
+Corrector::~Corrector() {
+    delete state;
+}
+
+int Corrector::Init(const RigConfig& config) {
+    delete state;
+    state = NULL;
+    int status = RigConfigValidate(config);
+    if (status != CORRECT_OK) return status;
+
+    CorrectorState* built = new CorrectorState();
+    built->config = config;
+    RigTransforms rig = GetRigTransforms(RigConfigToParameters(config));
+    for (int i = 0; i < 9; i++) built->master_to_slave[i] = rig.master_to_slave.at<double>(i / 3, i % 3);
+    BuildBrightnessContrastLut(config.brightness, config.contrast, built->lut);
+    built->indices.reserve(config.master_width);
+    built->points.reserve(config.master_width);
+    built->values.reserve(config.master_width);
+    state = built;
+    return CORRECT_OK;
+}
+
+int Corrector::Correct(const ImageView& master, const ImageView& slave, const OutputView& output) {
+    if (!state) return CORRECT_NOT_INITIALIZED;
+    const RigConfig& config = state->config;
+    if (!ViewIsValid(master.data, master.width, master.height, master.step, config.master_width, config.master_height) ||
+        !ViewIsValid(slave.data, slave.width, slave.height, slave.step, config.slave_width, config.slave_height) ||
+        !ViewIsValid(output.data, output.width, output.height, output.step, config.master_width, config.master_height)) return CORRECT_INVALID_VIEW;
+    size_t row_bytes = (size_t)master.width * sizeof(unsigned short);
+    size_t master_step = master.step ? master.step : row_bytes;
+    size_t output_step = output.step ? output.step : row_bytes;
+    cv::Mat slave_image(slave.height, slave.width, CV_16UC1, (void*)slave.data, slave.step ? slave.step : (size_t)slave.width * sizeof(unsigned short)); //header only, no copy
+    const double* m = state->master_to_slave;
+    std::vector<unsigned int>& indices = state->indices;
+    std::vector<cv::Point2f>& points = state->points;
+    std::vector<int>& values = state->values;
+    state->hot = state->corrected = 0;
+
+    for (int y = 0; y < master.height; y++) {
+        const unsigned short* row = (const unsigned short*)((const unsigned char*)master.data + y * master_step);
+        unsigned short* out = (unsigned short*)((unsigned char*)output.data + y * output_step);
+        if (out != row) memcpy(out, row, row_bytes);
+
+        //// Hot pixels of the row, taken to slave raw coordinates
+        indices.clear();
+        RowGetHotIndices(row, master.width, (unsigned short)config.threshold, 0, indices);
+        if (indices.empty()) continue;
+        points.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            double x = indices[i];
+            double w = m[6] * x + m[7] * y + m[8];
+            if (fabs(w) > DBL_EPSILON) points[i] = cv::Point2f((float)((m[0] * x + m[1] * y + m[2]) / w), (float)((m[3] * x + m[4] * y + m[5]) / w));
+            else points[i] = cv::Point2f(-FLT_MAX, -FLT_MAX); //outside the slave
+        }
+
+        //// Slave values with brightness and contrast, set where the point is inside the slave
+        BufferGatherValues(slave_image, points, config.interpolation, values, &state->lut[0]);
+        for (size_t i = 0; i < indices.size(); i++) {
+            if (values[i] < 0) continue;
+            out[indices[i]] = (unsigned short)values[i];
+            state->corrected++;
+        }
+        state->hot += indices.size();
+    }
+    return CORRECT_OK;
+}
+
+size_t Corrector::HotPixels() const {
+    return state ? state->hot : 0;
+}
+
+size_t Corrector::Corrected() const {
+    return state ? state->corrected : 0;
+}
@@ -0,0 +1,138 @@
+/*
+- Library interface of multi_cam, to correct master/slave pairs inside another program (e.g. the acquisition software) instead of running the multi_cam command.
+- Build libmulticam.a with make lib and link it with the OpenCV, ImageMagick and libtiff libraries of the Makefile. Only this header is needed by the program, multi_cam.h is compiled into the library with internal linkage so its names do not clash with the program.
+- Usage:
+    RigConfig config;
+    RigConfigLoad("config.cfg", config); //or fill the fields directly
+    config.master_width = config.slave_width = 4656;
+    config.master_height = config.slave_height = 3520;
+    Corrector corrector;
+    if (corrector.Init(config) != CORRECT_OK) ...
+    for every frame: corrector.Correct(ImageView(master, 4656, 3520), ImageView(slave, 4656, 3520), OutputView(corrected, 4656, 3520));
+*/
+
+#ifndef MULTI_CAM_LIB_H
+#define MULTI_CAM_LIB_H
+
+#include <string>
+#include <cstddef>
+
+
+//Return codes of the library
+const int CORRECT_OK = 0;
+const int CORRECT_FILE_ERROR = 1; //config file could not be read
+const int CORRECT_INVALID_CONFIG = 2; //RigConfig failed validation, see RigConfigValidate()
+const int CORRECT_NOT_INITIALIZED = 3; //Correct() called before a successful Init()
+const int CORRECT_INVALID_VIEW = 4; //null buffer, size different from the RigConfig or stride shorter than a row
+
+//Class to store the registration of one camera: 4 points in the raw image and where they go in the flat image, and the rotation applied before
+class RigQuad {
+public:
+    float source_x[4], source_y[4]; //raw image points: top-left, top-right, bottom-left, bottom-right
+    float dest_x[4], dest_y[4]; //flat image points, same order
+    double rotation; //angle of rotation around origin of image (coordinates 0 0), positive clockwise
+
+    RigQuad();
+};
+
+//Class to store the typed config of a rig, the values of the config file used by the correction
+class RigConfig {
+public:
+    RigQuad master, slave; //Master* and Slave* registration points and rotation
+    int master_width, master_height; //size of the master frames
+    int slave_width, slave_height; //size of the slave frames
+    long threshold; //MasterThresholdHotPixels: pixels equal or above are corrected, 0-65535
+    double brightness, contrast; //SlaveBrightness and SlaveContrast in percent, -100 to 100
+    int interpolation; //SlaveInterpolation: 0 nearest, 1 bilinear, 2 bicubic
+
+    RigConfig();
+};
+
+//Class of a read-only view of a 16-bit grayscale frame owned by the caller
+class ImageView {
+public:
+    const unsigned short* data; //first pixel
+    int width, height; //size in pixels
+    size_t step; //bytes from a row to the next, 0 for width * 2
+
+    ImageView(const unsigned short* data = NULL, int width = 0, int height = 0, size_t step = 0) : data(data), width(width), height(height), step(step) {}
+};
+
+//Class of a writable view of a 16-bit grayscale frame owned by the caller, it may be the same buffer as the master view
+class OutputView {
+public:
+    unsigned short* data; //first pixel
+    int width, height; //size in pixels
+    size_t step; //bytes from a row to the next, 0 for width * 2
+
+    OutputView(unsigned short* data = NULL, int width = 0, int height = 0, size_t step = 0) : data(data), width(width), height(height), step(step) {}
+};
+
+/************************
+Read a RigConfig from a config file in the format of config_example.cfg. The frame sizes are not in the config file and are not changed.
+SlaveBrightness, SlaveContrast and SlaveInterpolation are optional, their fields keep their values (the RigConfig() defaults) when they are not in the file.
+<filename> is the config file.
+<config> receives the values.
+Returns CORRECT_OK, CORRECT_FILE_ERROR or CORRECT_INVALID_CONFIG.
+*************************/
+int RigConfigLoad(std::string filename, RigConfig& config);
+
+/************************
+Check a RigConfig: frame sizes, threshold, brightness, contrast and interpolation in range, and registration quads that give invertible transforms.
+<config> is the config to check.
+Returns CORRECT_OK or CORRECT_INVALID_CONFIG.
+*************************/
+int RigConfigValidate(const RigConfig& config);
+
+/************************
+Text of a return code.
+<status> is a CORRECT_* code.
+Returns the description.
+*************************/
+const char* CorrectStatusText(int status);
+
+/************************
+Rebuild a corrected frame from the raw master and the sidecar written for it by the multi_cam command with OutputMode=1 or 2.
+<filename> is the .mcs sidecar file.
+<frame> has the raw master, the corrected pixels are set in it.
+Returns CORRECT_OK, CORRECT_FILE_ERROR (sidecar missing, corrupted or written on a machine of another byte order) or CORRECT_INVALID_VIEW (frame of another size than the sidecar).
+*************************/
+int SidecarApplyToView(std::string filename, const OutputView& frame);
+
+class CorrectorState;
+
+//Class to correct frames of one rig. Transforms, brightness and contrast table and scratch buffers are built once by Init(), Correct() does no heap allocation.
+//A Corrector is used by one thread at a time, use one per thread to correct frames in parallel.
+class Corrector {
+public:
+    Corrector();
+    ~Corrector();
+
+    /************************
+    Validate the config and build the transforms, the brightness and contrast table and the scratch buffers.
+    <config> is the typed config of the rig.
+    Returns CORRECT_OK or CORRECT_INVALID_CONFIG.
+    *************************/
+    int Init(const RigConfig& config);
+
+    /************************
+    Correct a frame: copy the master to the output (unless they are the same buffer) and replace every hot pixel with the slave value at the same point of the scene.
+    <master> and <slave> are the raw frames, of the sizes of the RigConfig.
+    <output> receives the corrected master, of the master size.
+    Returns CORRECT_OK, CORRECT_NOT_INITIALIZED or CORRECT_INVALID_VIEW.
+    *************************/
+    int Correct(const ImageView& master, const ImageView& slave, const OutputView& output);
+
+    //Number of hot pixels found by the last Correct()
+    size_t HotPixels() const;
+
+    //Number of hot pixels replaced by the last Correct(), the others map outside the slave frame
+    size_t Corrected() const;
+
+private:
+    CorrectorState* state;
+    Corrector(const Corrector&);
+    Corrector& operator=(const Corrector&);
+};
+
+#endif